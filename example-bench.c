@@ -0,0 +1,316 @@
+// Build with: build example-bench
+//
+// Measures the hot paths of the engine and prints the results to the log and screen.
+
+#define PUNITY_IMPLEMENTATION
+#include "punity.h"
+
+#define BENCH_REPEAT (100)
+#define BENCH_RESULTS_MAX (32)
+
+typedef struct BenchResult_
+{
+    char name[48];
+    f64 ms;
+}
+BenchResult;
+
+typedef struct Game_
+{
+    Bitmap font;
+    BenchResult results[BENCH_RESULTS_MAX];
+    i32 results_count;
+}
+Game;
+
+static Game *GAME = 0;
+
+static void
+bench_result(const char *name, f64 seconds)
+{
+    ASSERT(GAME->results_count != BENCH_RESULTS_MAX);
+    BenchResult *result = GAME->results + GAME->results_count++;
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->ms = (seconds * 1e3) / BENCH_REPEAT;
+    LOG("%-32s %8.4fms\n", result->name, result->ms);
+}
+
+//
+// Scaling
+//
+
+static void
+bench_scale()
+{
+    static const struct { const char *name; i32 scale; int filter; } cases[] = {
+        { "bitmap_scale nearest 2x", 2, ScaleFilter_Nearest },
+        { "bitmap_scale nearest 3x", 3, ScaleFilter_Nearest },
+        { "bitmap_scale nearest 4x", 4, ScaleFilter_Nearest },
+        { "bitmap_scale epx 2x",     2, ScaleFilter_EPX },
+        { "bitmap_scale epx 3x",     3, ScaleFilter_EPX },
+    };
+
+    BankState bank_state = bank_begin(CORE->stack);
+
+    Bitmap source;
+    bitmap_init_ex_(CORE->stack, &source, 320, 200, 0, 0, 0, 0);
+    for (i32 i = 0; i != source.width * source.height; ++i) {
+        source.pixels[i] = (u8)(rand() % 4);
+    }
+
+    Bitmap destination = {0};
+    for (i32 c = 0; c != array_count(cases); ++c)
+    {
+        destination.width  = source.width  * cases[c].scale;
+        destination.height = source.height * cases[c].scale;
+        destination.pitch  = destination.width;
+        destination.pixels = bank_push_t(CORE->stack, u8, destination.width * destination.height);
+
+        f64 p = perf_get();
+        for (i32 i = 0; i != BENCH_REPEAT; ++i) {
+            bitmap_scale(&destination, &source, cases[c].scale, cases[c].filter);
+        }
+        bench_result(cases[c].name, perf_get() - p);
+    }
+
+    Present present;
+    for (i32 scale = 1; scale <= 3; ++scale)
+    {
+        present_init(&present, CORE->stack, source.width, source.height, scale, ScaleFilter_Nearest, false);
+        f64 p = perf_get();
+        for (i32 i = 0; i != BENCH_REPEAT; ++i) {
+            present_invalidate(&present);
+            present_update(&present, &source, CORE->palette->colors);
+        }
+        char name[48];
+        snprintf(name, sizeof(name), "present_update full %dx", scale);
+        bench_result(name, perf_get() - p);
+    }
+
+    bank_end(&bank_state);
+}
+
+//
+// Packed bitmaps
+//
+
+static void
+bench_packed()
+{
+    BankState bank_state = bank_begin(CORE->stack);
+
+    Bitmap target;
+    bitmap_init_ex_(CORE->stack, &target, 320, 200, 0, 0, 0, 0);
+    canvas_push(&target);
+
+    Bitmap sprites[3];
+    bitmap_init_ex_(CORE->stack, &sprites[0], 256, 128, 0, 0, 0, 0);
+    for (i32 i = 0; i != sprites[0].width * sprites[0].height; ++i) {
+        sprites[0].pixels[i] = (u8)(rand() % 16);
+    }
+    bitmap_pack(CORE->stack, &sprites[1], &sprites[0], BitmapFormat_4, 0);
+    for (i32 i = 0; i != sprites[0].width * sprites[0].height; ++i) {
+        sprites[0].pixels[i] = (u8)(rand() % 2);
+    }
+    bitmap_pack(CORE->stack, &sprites[2], &sprites[0], BitmapFormat_1, 0);
+
+    static const char *names[] = {
+        "bitmap_draw 8bpp 256x128",
+        "bitmap_draw 4bpp 256x128",
+        "bitmap_draw 1bpp 256x128",
+    };
+    for (i32 s = 0; s != array_count(sprites); ++s)
+    {
+        f64 p = perf_get();
+        for (i32 i = 0; i != BENCH_REPEAT; ++i) {
+            bitmap_draw(&sprites[s], 32, 32, 0, 0, 0);
+        }
+        bench_result(names[s], perf_get() - p);
+    }
+
+    canvas_pop();
+    bank_end(&bank_state);
+}
+
+//
+// Spatial hash
+//
+
+// Chained spatial hash with `7x + 3y` modulo prime number of buckets that
+// `SpatialHash` used before, kept here as the baseline.
+typedef struct ChainedHash_
+{
+    Deque cells;
+    size_t buckets_count;
+    SpatialCell **buckets;
+    SpatialCell *pool;
+}
+ChainedHash;
+
+#define chainedhash_bucket(H, X, Y) ((size_t)((u32)(7*(X) + 3*(Y)) % (H)->buckets_count))
+
+static void
+chainedhash_add(ChainedHash *H, Rect range, void *item)
+{
+    for (i32 y = range.min_y; y != range.max_y; ++y) {
+        for (i32 x = range.min_x; x != range.max_x; ++x)
+        {
+            SpatialCell **bucket = H->buckets + chainedhash_bucket(H, x, y);
+            SpatialCell *cell = *bucket;
+            while (cell && (cell->x != x || cell->y != y || cell->items_count == array_count(cell->items))) {
+                cell = cell->next;
+            }
+            if (!cell) {
+                cell = H->pool;
+                if (cell) {
+                    H->pool = cell->next;
+                } else {
+                    cell = deque_push_t(&H->cells, SpatialCell);
+                }
+                cell->items_count = 0;
+                cell->x = x;
+                cell->y = y;
+                cell->next = *bucket;
+                *bucket = cell;
+            }
+            cell->items[cell->items_count++] = item;
+        }
+    }
+}
+
+static void
+chainedhash_remove(ChainedHash *H, Rect range, void *item)
+{
+    for (i32 y = range.min_y; y != range.max_y; ++y) {
+        for (i32 x = range.min_x; x != range.max_x; ++x)
+        {
+            SpatialCell **link = H->buckets + chainedhash_bucket(H, x, y);
+            for (SpatialCell *cell = *link; cell; link = &cell->next, cell = cell->next) {
+                if (cell->x != x || cell->y != y) {
+                    continue;
+                }
+                for (i32 i = 0; i != cell->items_count; ++i) {
+                    if (cell->items[i] == item) {
+                        cell->items[i] = cell->items[--cell->items_count];
+                        if (cell->items_count == 0) {
+                            *link = cell->next;
+                            cell->next = H->pool;
+                            H->pool = cell;
+                        }
+                        goto next;
+                    }
+                }
+            }
+next:;
+        }
+    }
+}
+
+static SpatialCell *
+chainedhash_get_cell(ChainedHash *H, i32 x, i32 y)
+{
+    SpatialCell *cell = H->buckets[chainedhash_bucket(H, x, y)];
+    while (cell && (cell->x != x || cell->y != y)) {
+        cell = cell->next;
+    }
+    return cell;
+}
+
+#define BENCH_SPATIAL_ITEMS (2048)
+
+static void
+bench_spatial()
+{
+    BankState bank_state = bank_begin(CORE->stack);
+
+    // Items on a grid-aligned 256x256 cell world, each covering 1 to 2x2 cells.
+    Rect *ranges = bank_push_t(CORE->stack, Rect, BENCH_SPATIAL_ITEMS);
+    for (i32 i = 0; i != BENCH_SPATIAL_ITEMS; ++i) {
+        i32 x = (rand() % 128) * 2;
+        i32 y = (rand() % 128) * 2;
+        ranges[i] = rect_make(x, y, x + 1 + (rand() & 1), y + 1 + (rand() & 1));
+    }
+
+    ChainedHash chained;
+    memset(&chained, 0, sizeof(ChainedHash));
+    chained.buckets_count = 5003;
+    chained.buckets = bank_push_t(CORE->stack, SpatialCell*, chained.buckets_count);
+    memset(chained.buckets, 0, chained.buckets_count * sizeof(SpatialCell*));
+    deque_init(&chained.cells, sizeof(SpatialCell) * 256);
+
+    SpatialHash hash;
+    spatialhash_init(&hash, 4096);
+
+    volatile u32 found = 0;
+    f64 p;
+
+    p = perf_get();
+    for (i32 r = 0; r != BENCH_REPEAT; ++r) {
+        for (i32 i = 0; i != BENCH_SPATIAL_ITEMS; ++i) {
+            chainedhash_add(&chained, ranges[i], ranges + i);
+        }
+        for (i32 y = 0; y != 256; ++y) {
+            for (i32 x = 0; x != 256; ++x) {
+                found += chainedhash_get_cell(&chained, x, y) != 0;
+            }
+        }
+        for (i32 i = 0; i != BENCH_SPATIAL_ITEMS; ++i) {
+            chainedhash_remove(&chained, ranges[i], ranges + i);
+        }
+    }
+    bench_result("spatial hash chained", perf_get() - p);
+
+    p = perf_get();
+    for (i32 r = 0; r != BENCH_REPEAT; ++r) {
+        for (i32 i = 0; i != BENCH_SPATIAL_ITEMS; ++i) {
+            spatialhash_add(&hash, ranges[i], ranges + i);
+        }
+        for (i32 y = 0; y != 256; ++y) {
+            for (i32 x = 0; x != 256; ++x) {
+                found += spatialhash_get_cell(&hash, x, y) != 0;
+            }
+        }
+        for (i32 i = 0; i != BENCH_SPATIAL_ITEMS; ++i) {
+            spatialhash_remove(&hash, ranges[i], ranges + i);
+        }
+    }
+    bench_result("spatial hash open addressing", perf_get() - p);
+
+    spatialhash_free(&hash);
+    deque_free(&chained.cells);
+    bank_end(&bank_state);
+}
+
+int
+init()
+{
+    CORE->window.width = 256;
+    CORE->window.height = 160;
+    CORE->window.scale = 3;
+
+    GAME = bank_push_t(CORE->storage, Game, 1);
+    font_load_resource(&GAME->font, "font.png", 4, 7);
+    CORE->canvas.font = &GAME->font;
+
+    bench_scale();
+    bench_packed();
+    bench_spatial();
+
+    return 1;
+}
+
+void
+step()
+{
+    if (key_pressed(KEY_ESCAPE)) {
+        CORE->running = 0;
+    }
+
+    canvas_clear(1);
+
+    char buf[256];
+    for (i32 i = 0; i != GAME->results_count; ++i) {
+        sprintf(buf, "%-32s %8.4fms", GAME->results[i].name, GAME->results[i].ms);
+        text_draw(buf, 2, 2 + i * 8, 2);
+    }
+}
@@ -8,6 +8,7 @@ static struct
     SDL_GLContext *context;
 
     GLuint texture;
+    Present present;
 }
 punp_runtime_sdl;
 
@@ -188,12 +189,25 @@ main(int argc, char **argv)
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 
+    Present *present = &punp_runtime_sdl.present;
+    i32 present_scale = 1;
+    if (CORE->window.filter == ScaleFilter_EPX) {
+        present_scale = clamp((i32)CORE->window.scale, 2, 3);
+    }
+    present_init(present, CORE->storage,
+        CORE->window.width, CORE->window.height,
+        present_scale, CORE->window.filter, false);
+
     glEnable(GL_TEXTURE_2D);
 
     glGenTextrues(1, &punp_runtime_sdl.texture);
     glBindTexture(GL_TEXTURE_2D, punp_runtime_sdl.texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    // Allocate the texture, only changed rows are uploaded per frame.
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+        present->pixels_width, present->pixels_height,
+        0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
     
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
@@ -201,10 +215,6 @@ main(int argc, char **argv)
 
     SDL_StartTextInput();
 
-    GLuint *window_buffer = bank_push(CORE->storage, CORE->window.width * CORE->window.height * sizeof(u32));
-    GLuint *window_row;
-    u8  *canvas_it;
-
     int x, y;
     u8 key;
     SDL_Event sdl_event;
@@ -254,16 +264,14 @@ main(int argc, char **argv)
 
         glClear(GL_COLOR_BUFFER_BIT);
 
-        window_row = window_buffer;
-        canvas_it = CORE->canvas.bitmap->pixels;
-        for (y = 0; y != CORE->window.height; ++y) {
-            for (x = 0; x != CORE->window.width; ++x) {
-                *(window_row++) = CORE->palette->colors[*canvas_it++].rgba;
-            }
-        }
-
         glBindTexture(GL_TEXTURE_2D, punp_runtime_sdl.texture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, CORE->window.width, CORE->window.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, window_buffer);
+        if (present_update(present, CORE->canvas.bitmap, CORE->palette_snapshot->colors)) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0,
+                0, present->dirty_min_y,
+                present->pixels_width, present->dirty_max_y - present->dirty_min_y,
+                GL_BGRA, GL_UNSIGNED_BYTE,
+                present->pixels + (present->dirty_min_y * present->pixels_width));
+        }
 
         glBegin(GL_QUADS);
             glTexCoord2f(0.0f, 0.0f); glVertex2f(0.0f, 0.0f);
@@ -308,6 +308,34 @@ tiled_load_meta_(TiledLoader_ *L, int type, void *data, json_value *properties)
     }
 }
 
+// Adds `animation` of the tile (frames with `tileid` and `duration` in milliseconds).
+static void
+tiled_load_animation_(Bitmap *tileset, int index, json_value *value_tile)
+{
+    json_value *value_animation = json_find_value(value_tile, "animation");
+    if (!value_animation || value_animation->type != json_array || value_animation->array.length == 0) {
+        return;
+    }
+
+    BankState bank_state = bank_begin(CORE->stack);
+    TileFrame *frames = bank_push_t(CORE->stack, TileFrame, value_animation->array.length);
+    int frames_count = 0;
+    json_value **it = value_animation->array.values;
+    for (uint i = 0; i != value_animation->array.length; ++i, ++it) {
+        json_value *value_id = json_find_value(*it, "tileid");
+        json_value *value_duration = json_find_value(*it, "duration");
+        if (value_id && value_duration) {
+            frames[frames_count].index = value_id->integer;
+            frames[frames_count].duration = value_duration->integer / 1000.0f;
+            frames_count++;
+        }
+    }
+    if (frames_count) {
+        tile_animation_add(tileset, index, frames, frames_count);
+    }
+    bank_end(&bank_state);
+}
+
 static void
 tiled_load_tileset_(TiledLoader_ *L, json_value *value, int *firstgid)
 {
@@ -356,6 +384,28 @@ tiled_load_tileset_(TiledLoader_ *L, json_value *value, int *firstgid)
                 tiled_load_meta_(L, TiledType_Tile, &tiled_tileset->tiles[index], it_tile->value);
             }
         }
+
+        // Load animations, `tiles` is an object keyed by tile id or an array of tiles with `id`.
+        v = json_find_value(value, "tiles");
+        if (v && v->type == json_object)
+        {
+            json_object_entry *it_tile = v->object.values;
+            for (uint j = 0; j != v->object.length; ++j, ++it_tile) {
+                char *name_end = it_tile->name + it_tile->name_length;
+                int index = strtol(it_tile->name, &name_end, 10);
+                tiled_load_animation_(tileset, index, it_tile->value);
+            }
+        }
+        else if (v && v->type == json_array)
+        {
+            json_value **it_tile = v->array.values;
+            for (uint j = 0; j != v->array.length; ++j, ++it_tile) {
+                json_value *value_id = json_find_value(*it_tile, "id");
+                if (value_id) {
+                    tiled_load_animation_(tileset, value_id->integer, *it_tile);
+                }
+            }
+        }
         return;
     }
 
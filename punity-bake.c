@@ -0,0 +1,407 @@
+// Build with: build punity-bake
+// Usage:      punity-bake <manifest or rc> <pack or c>
+//
+// Bakes assets listed in the manifest to a pack that can be used in place with `pack_open`.
+// Bitmaps are converted to palette indices here, so the game doesn't need to decode
+// and quantize them on startup, and sounds are decoded to PCM.
+//
+// Manifest is a text file with one command per line (paths are relative to current directory):
+//
+//     # Comment.
+//     palette <path> <offset>                      -- palette_load
+//     range <begin> <end> <it>                     -- palette_range_add
+//     bitmap <name> <path> <range> [<tile_width> <tile_height>]
+//     font <name> <path> <tile_width> <tile_height>
+//     sound <name> <path>                          -- OGG decoded to PCM
+//     raw <name> <path>                            -- stored as is
+//
+// Commands are executed in order as if they were called in `init()`, the resulting palette
+// is stored to the pack and has to be loaded with `pack_palette_load`.
+//
+// If the input is a `.rc` file, its RESOURCE entries are stored as raw entries,
+// which makes the pack usable by `resource_get` with PUNITY_RESOURCES_PACK:
+//
+//     punity-bake main.rc bin/resources.pak
+//
+// If the output is a `.c` file, the pack is written as `punity_resources` array
+// to be compiled with the game with PUNITY_RESOURCES_EMBEDDED.
+
+#define PUNITY_LIB 1
+#define PUNITY_IMPLEMENTATION
+#include "punity.h"
+
+#define BAKE_LINE_MAX (1024)
+
+typedef struct BakeEntry_
+{
+    PackEntry entry;
+    char name[256];
+    void *data;
+    size_t size;
+}
+BakeEntry;
+
+typedef struct Bake_
+{
+    BakeEntry *entries;
+    u32 entries_count;
+    u32 entries_capacity;
+}
+Bake;
+
+static Bake BAKE = {0};
+
+static void
+bake_init()
+{
+#if PUNITY_SIMD
+    simd_init__();
+#endif
+
+    static Bank s_stack = {0};
+    static Bank s_storage = {0};
+    static Core s_core = {0};
+    CORE = &s_core;
+
+    static Palette s_palette;
+    CORE->palette = &s_palette;
+    palette_init(CORE->palette);
+    palette_color_set(CORE->palette, PUN_COLOR_TRANSPARENT, color_make(0x00, 0x00, 0x00, 0x00));
+    palette_color_set(CORE->palette, 1, color_make(0x00, 0x00, 0x00, 0xFF));
+    palette_color_set(CORE->palette, 2, color_make(0xFF, 0xFF, 0xFF, 0xFF));
+
+    CORE->stack = &s_stack;
+    CORE->storage = &s_storage;
+    bank_init(CORE->stack, megabytes(64));
+    bank_init(CORE->storage, megabytes(512));
+}
+
+static BakeEntry *
+bake_entry_add(const char *name, u32 type)
+{
+    if (strlen(name) >= sizeof(BAKE.entries->name)) {
+        printf("Name `%s` is too long.\n", name);
+        return 0;
+    }
+    for (u32 i = 0; i != BAKE.entries_count; ++i) {
+        if (strcmp(BAKE.entries[i].name, name) == 0) {
+            printf("Duplicate name `%s`.\n", name);
+            return 0;
+        }
+    }
+    if (BAKE.entries_count == BAKE.entries_capacity) {
+        BAKE.entries_capacity = maximum(64, BAKE.entries_capacity * 2);
+        BAKE.entries = realloc(BAKE.entries, BAKE.entries_capacity * sizeof(BakeEntry));
+        ASSERT(BAKE.entries);
+    }
+    BakeEntry *entry = BAKE.entries + BAKE.entries_count++;
+    memset(entry, 0, sizeof(BakeEntry));
+    strcpy(entry->name, name);
+    entry->entry.type = type;
+    entry->entry.hash = pack_hash(name);
+    return entry;
+}
+
+static bool
+bake_bitmap(const char *name, const char *path, int type, int range, i32 tile_width, i32 tile_height)
+{
+    int width, height, comp;
+    Color *pixels = (Color *)stbi_load(path, &width, &height, &comp, STBI_rgb_alpha);
+    if (!pixels) {
+        printf("Unable to load bitmap %s\n", path);
+        return false;
+    }
+
+    Bitmap bitmap;
+    bitmap_init_ex_(CORE->storage, &bitmap, (i32)width, (i32)height, pixels, type, range, path);
+    free(pixels);
+
+    BakeEntry *entry = bake_entry_add(name, PackEntry_Bitmap);
+    if (!entry) {
+        return false;
+    }
+    entry->entry.bitmap.width         = bitmap.width;
+    entry->entry.bitmap.height        = bitmap.height;
+    entry->entry.bitmap.pitch         = bitmap.pitch;
+    entry->entry.bitmap.palette_range = bitmap.palette_range;
+    entry->entry.bitmap.tile_width    = tile_width;
+    entry->entry.bitmap.tile_height   = tile_height;
+    entry->data = bitmap.pixels;
+    // Whole allocation, so the SIMD blitters can read past the last row as they do with `bitmap_init`.
+    entry->size = bitmap.pitch * bitmap.height;
+    return true;
+}
+
+static bool
+bake_sound(const char *name, const char *path)
+{
+    int error = 0;
+    stb_vorbis *stream = stb_vorbis_open_filename(path, &error, 0);
+    if (error || !stream) {
+        printf("Unable to load sound %s\n", path);
+        return false;
+    }
+
+    Sound sound = {0};
+    sound_load_stbv_(&sound, stream);
+
+    BakeEntry *entry = bake_entry_add(name, PackEntry_Sound);
+    if (!entry) {
+        return false;
+    }
+    entry->entry.sound.channels      = sound.channels;
+    entry->entry.sound.rate          = sound.rate;
+    entry->entry.sound.samples_count = (u32)sound.samples_count;
+    entry->data = sound.samples;
+    entry->size = PUNP_SOUND_SAMPLES_TO_BYTES(sound.samples_count, sound.channels);
+    return true;
+}
+
+static bool
+bake_raw(const char *name, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Unable to open %s\n", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    void *data = bank_push(CORE->storage, (u32)size);
+    size_t read = fread(data, 1, size, file);
+    fclose(file);
+    if (read != size) {
+        printf("Unable to read %s\n", path);
+        return false;
+    }
+
+    BakeEntry *entry = bake_entry_add(name, PackEntry_Raw);
+    if (!entry) {
+        return false;
+    }
+    entry->data = data;
+    entry->size = size;
+    return true;
+}
+
+static bool
+bake_manifest(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("Unable to open manifest %s\n", path);
+        return false;
+    }
+
+    char line[BAKE_LINE_MAX];
+    char command[32], name[256], value[BAKE_LINE_MAX];
+    int a, b, c;
+    int line_number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        ++line_number;
+        if (sscanf(line, "%31s", command) != 1 || command[0] == '#') {
+            continue;
+        }
+
+        if (strcmp(command, "palette") == 0 && sscanf(line, "%*s %1023s %d", value, &a) == 2) {
+            palette_load(CORE->palette, value, a);
+        } else if (strcmp(command, "range") == 0 && sscanf(line, "%*s %d %d %d", &a, &b, &c) == 3) {
+            printf("Range %d\n", palette_range_add(CORE->palette, a, b, c));
+        } else if (strcmp(command, "bitmap") == 0 && sscanf(line, "%*s %255s %1023s %d", name, value, &a) == 3) {
+            b = c = 0;
+            sscanf(line, "%*s %*s %*s %*d %d %d", &b, &c);
+            ok = bake_bitmap(name, value, PUN_BITMAP_32, a, b, c);
+        } else if (strcmp(command, "font") == 0 && sscanf(line, "%*s %255s %1023s %d %d", name, value, &a, &b) == 4) {
+            ok = bake_bitmap(name, value, PUN_BITMAP_MASK, 0, a, b);
+        } else if (strcmp(command, "sound") == 0 && sscanf(line, "%*s %255s %1023s", name, value) == 2) {
+            ok = bake_sound(name, value);
+        } else if (strcmp(command, "raw") == 0 && sscanf(line, "%*s %255s %1023s", name, value) == 2) {
+            ok = bake_raw(name, value);
+        } else {
+            printf("%s:%d: Invalid command.\n", path, line_number);
+            ok = false;
+        }
+    }
+
+    fclose(file);
+    return ok;
+}
+
+static bool
+bake_ends_with(const char *string, const char *suffix)
+{
+    size_t string_length = strlen(string);
+    size_t suffix_length = strlen(suffix);
+    return string_length >= suffix_length
+        && strcmp(string + string_length - suffix_length, suffix) == 0;
+}
+
+// Parses `<name> RESOURCE "<path>"` lines, other resource types (like ICON) are skipped.
+static bool
+bake_rc(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("Unable to open %s\n", path);
+        return false;
+    }
+
+    char line[BAKE_LINE_MAX];
+    char name[256], type[32], value[BAKE_LINE_MAX];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "%255s %31s \"%1023[^\"]\"", name, type, value) != 3
+            || strcmp(type, "RESOURCE") != 0)
+        {
+            continue;
+        }
+
+        // Paths are escaped (`res\\font.png`), use forward slashes that work everywhere.
+        char *write = value;
+        for (char *read = value; *read; ++read) {
+            if (*read == '\\') {
+                *write++ = '/';
+                if (read[1] == '\\') {
+                    ++read;
+                }
+            } else {
+                *write++ = *read;
+            }
+        }
+        *write = 0;
+
+        ok = bake_raw(name, value);
+    }
+
+    fclose(file);
+    return ok;
+}
+
+static bool
+bake_write_c(const char *path, u8 *data, u32 size)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file,
+        "// Generated by punity-bake.\n"
+        "#include <stddef.h>\n"
+        "#ifdef _MSC_VER\n"
+        "__declspec(align(16))\n"
+        "#else\n"
+        "__attribute__((aligned(16)))\n"
+        "#endif\n"
+        "const unsigned char punity_resources[%u] = {", size);
+    for (u32 i = 0; i != size; ++i) {
+        fprintf(file, "%s%u,", (i % 32) == 0 ? "\n" : "", data[i]);
+    }
+    fprintf(file, "\n};\nconst size_t punity_resources_size = %u;\n", size);
+    return fclose(file) == 0;
+}
+
+static bool
+bake_write(const char *path)
+{
+    Palette *palette = CORE->palette;
+
+    u32 index_count = 16;
+    while (index_count < BAKE.entries_count * 2) {
+        index_count *= 2;
+    }
+
+    PackHeader header = {0};
+    header.magic = PUN_PACK_MAGIC;
+    header.version = PUN_PACK_VERSION;
+    header.entries_count = BAKE.entries_count;
+    header.index_count = index_count;
+
+    u32 offset = sizeof(PackHeader);
+    header.index_offset = offset;
+    offset += index_count * sizeof(u32);
+    header.entries_offset = offset;
+    offset += BAKE.entries_count * sizeof(PackEntry);
+    for (u32 i = 0; i != BAKE.entries_count; ++i) {
+        BAKE.entries[i].entry.name_offset = offset;
+        offset += (u32)strlen(BAKE.entries[i].name) + 1;
+    }
+    offset = align_to(offset, 4);
+    header.palette_offset = offset;
+    offset += sizeof(PackPalette) + palette->ranges_count * sizeof(PackPaletteRange);
+    for (u32 i = 0; i != BAKE.entries_count; ++i) {
+        offset = align_to(offset, PUN_PACK_ALIGN);
+        BAKE.entries[i].entry.data_offset = offset;
+        BAKE.entries[i].entry.data_size = (u32)BAKE.entries[i].size;
+        offset += (u32)BAKE.entries[i].size;
+    }
+    header.size = offset;
+
+    u8 *data = calloc(1, header.size);
+    ASSERT(data);
+    memcpy(data, &header, sizeof(PackHeader));
+
+    u32 *index = (u32*)(data + header.index_offset);
+    PackEntry *entries = (PackEntry*)(data + header.entries_offset);
+    for (u32 i = 0; i != BAKE.entries_count; ++i) {
+        BakeEntry *it = BAKE.entries + i;
+        entries[i] = it->entry;
+        strcpy((char*)data + it->entry.name_offset, it->name);
+        memcpy(data + it->entry.data_offset, it->data, it->size);
+
+        u32 slot = it->entry.hash & (index_count - 1);
+        while (index[slot]) {
+            slot = (slot + 1) & (index_count - 1);
+        }
+        index[slot] = i + 1;
+    }
+
+    PackPalette *pack_palette = (PackPalette*)(data + header.palette_offset);
+    memcpy(pack_palette->colors, palette->colors, sizeof(palette->colors));
+    PackPaletteRange *pack_ranges = (PackPaletteRange*)(pack_palette + 1);
+    pack_palette->ranges_count = palette->ranges_count;
+    for (int i = 0; i != palette->ranges_count; ++i) {
+        pack_ranges[i].begin = palette->ranges[i].begin;
+        pack_ranges[i].end = palette->ranges[i].end;
+        pack_ranges[i].it = palette->ranges[i].it;
+    }
+
+    bool ok = false;
+    if (bake_ends_with(path, ".c")) {
+        ok = bake_write_c(path, data, header.size);
+    } else {
+        FILE *file = fopen(path, "wb");
+        if (file) {
+            ok = fwrite(data, 1, header.size, file) == header.size;
+            fclose(file);
+        }
+    }
+    if (!ok) {
+        printf("Unable to write %s\n", path);
+    } else {
+        printf("Written %u entries (%u bytes) to %s\n", BAKE.entries_count, header.size, path);
+    }
+    free(data);
+    return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc != 3) {
+        printf("Usage: punity-bake <manifest or rc> <pack or c>\n");
+        return 1;
+    }
+
+    bake_init();
+    bool ok = bake_ends_with(argv[1], ".rc")
+        ? bake_rc(argv[1])
+        : bake_manifest(argv[1]);
+    if (!ok) {
+        return 1;
+    }
+    return bake_write(argv[2]) ? 0 : 1;
+}
@@ -73,6 +73,17 @@
 #define PUNITY_SIMD 1
 #endif
 
+// Enables AVX2 gathers for palette expansion when presenting the canvas.
+// Only available when compiling with AVX2 enabled (-mavx2 or /arch:AVX2).
+//
+#ifndef PUNITY_SIMD_AVX2
+    #ifdef __AVX2__
+        #define PUNITY_SIMD_AVX2 1
+    #else
+        #define PUNITY_SIMD_AVX2 0
+    #endif
+#endif
+
 // Enables/disables OpenGL blitting.
 // Minimal OpenGL loader provided.
 // Thanks to @ApoorvaJ.
@@ -133,6 +144,15 @@
 #define PUNITY_DRAW_LIST_RESERVE 4096
 #endif
 
+// Bitmaps initialized with pixels in `CORE->storage` that end up with the same
+// palette indices share the pixel memory (see `bitmap_init`).
+// Shared pixels are read-only, so only enable this if bitmaps loaded
+// with pixels are never drawn to or changed.
+//
+#ifndef PUNITY_BITMAP_DEDUPE
+#define PUNITY_BITMAP_DEDUPE 0
+#endif
+
 // Enables integration with `stb_image.h` library.
 // Allows for loading common image formats.
 //
@@ -147,6 +167,32 @@
 #define PUNITY_USE_STB_VORBIS 1
 #endif
 
+// Where `resource_get` finds resources.
+// 0 uses resources linked to the executable from the `.rc` file (Windows only).
+// 1 uses a pack baked from the `.rc` file with `punity-bake` (see `Pack`).
+//
+#ifndef PUNITY_RESOURCES_PACK
+    #if PUN_PLATFORM_WINDOWS
+        #define PUNITY_RESOURCES_PACK 0
+    #else
+        #define PUNITY_RESOURCES_PACK 1
+    #endif
+#endif
+
+// Path to the resources pack, it's mapped on the first `resource_get` call.
+//
+#ifndef PUNITY_RESOURCES_PACK_PATH
+#define PUNITY_RESOURCES_PACK_PATH "resources.pak"
+#endif
+
+// Links the resources pack to the executable instead of mapping the file.
+// Bake the pack to a `.c` file with `punity-bake` and compile it with the game,
+// it defines `punity_resources` and `punity_resources_size`.
+//
+#ifndef PUNITY_RESOURCES_EMBEDDED
+#define PUNITY_RESOURCES_EMBEDDED 0
+#endif
+
 // Sample rate used internally in Punity.
 // This rate is requested from the system (it's the most common one).
 // All audio is resampled to this frequency.
@@ -219,6 +265,44 @@ i32 rand_ir(u32 *x, i32 min, i32 max);
 
 f64 perf_get();
 
+//
+// Threads
+//
+
+#ifndef PUN_THREADS_MAX
+#define PUN_THREADS_MAX 32
+#endif
+
+#define THREAD_PROC(name) void name(void *user)
+typedef THREAD_PROC(ThreadProcF);
+
+typedef struct
+{
+    u64 handle;
+    ThreadProcF *proc;
+    void *user;
+}
+Thread;
+
+// Starts `proc` on a new thread. The `thread` has to live until `thread_join`.
+bool thread_start(Thread *thread, ThreadProcF *proc, void *user);
+// Waits for the thread to finish.
+void thread_join(Thread *thread);
+// Returns number of logical processors.
+i32 cpu_count();
+// Atomically adds `value` to `target` and returns the new value.
+i32 atomic_add(volatile i32 *target, i32 value);
+
+// `worker` is in range [0, cpu_count()) and is unique for threads running at the same time.
+#define PARALLEL_FOR_PROC(name) void name(void *user, i32 begin, i32 end, i32 worker)
+typedef PARALLEL_FOR_PROC(ParallelForProcF);
+
+// Splits [0, count) to ranges of `grain` items and calls `proc` for them
+// on up to `cpu_count()` threads (including the calling one).
+// The other threads are started on the first call and reused.
+// Returns when all ranges are done.
+void parallel_for(i32 count, i32 grain, ParallelForProcF *proc, void *user);
+
 //
 // Memory
 //
@@ -369,6 +453,8 @@ typedef struct
     int begin;
     int end;
     int it;
+    // Incremented whenever a color in the range is changed.
+    u32 version;
 }
 PaletteRange;
 
@@ -376,11 +462,31 @@ PaletteRange;
 #define PUN_PALETTE_RANGES_COUNT (16)
 #endif
 
+// Number of slots in the exact color lookup (1 << bits).
+#define PUN_PALETTE_LOOKUP_BITS (9)
+#define PUN_PALETTE_LOOKUP_SIZE (1 << PUN_PALETTE_LOOKUP_BITS)
+// Number of cells per channel in the nearest color cube.
+#define PUN_PALETTE_CUBE_BITS   (5)
+#define PUN_PALETTE_CUBE_SIZE   (1 << (PUN_PALETTE_CUBE_BITS * 3))
+// Cells hold the nearest color index and the distance margin to the second nearest.
+#define PUN_PALETTE_CUBE_BYTES  (PUN_PALETTE_CUBE_SIZE * 2)
+
 typedef struct
 {
+    // Change colors only with `palette_color_set`, `palette_color_add`
+    // or call `palette_changed` afterwards.
     Color colors[256];
     PaletteRange ranges[PUN_PALETTE_RANGES_COUNT];
     int ranges_count;
+    // Open addressed index of `colors` (index + 1, 0 is an empty slot).
+    // May contain stale entries, so the color has to be checked.
+    u16 lookup[PUN_PALETTE_LOOKUP_SIZE];
+    i32 lookup_count;
+    b32 lookup_valid;
+    // Nearest color cubes for each range, built lazily by `palette_color_find_nearest`
+    // and rebuilt when the range's version changes.
+    u8 *cubes[PUN_PALETTE_RANGES_COUNT];
+    u32 cubes_version[PUN_PALETTE_RANGES_COUNT];
 #ifdef PUN_PALETTE_RANGE_CUSTOM
     PUN_PALETTE_RANGE_CUSTOM
 #endif
@@ -394,6 +500,107 @@ int palette_range_add(Palette *palette, int begin, int end, int it);
 extern inline u8 palette_color_set(Palette *palette, u8 index, Color color);
 extern inline int palette_color_add(Palette *palette, Color color, int range);
 extern inline int palette_color_acquire(Palette *palette, Color color, int range);
+// Has to be called when `colors` were changed directly.
+void palette_changed(Palette *palette);
+// Returns index of the `color` in the `range`, or -1 if it's not there.
+int palette_color_find(Palette *palette, Color color, int range);
+// Returns index of the closest color in the `range` (Manhattan distance).
+int palette_color_find_fuzzy(Palette *palette, Color color, int range);
+// Same result as `palette_color_find_fuzzy`, but looks the color up in a cube
+// with PUN_PALETTE_CUBE_BITS per channel first and only searches the range when
+// the cell's nearest color isn't certain. The cube is rebuilt when the range
+// changes, use it for bulk lookups.
+int palette_color_find_nearest(Palette *palette, Color color, int range);
+
+// Sets `count` colors in `dst` to `src` colors blended towards `color` by `t` (0 to 1).
+// Alpha is kept from `src`. `dst` and `src` can be the same.
+void palette_lerp(Color *dst, Color *src, size_t count, Color color, f32 t);
+
+//
+// Palette effects
+//
+
+// Effects are applied on the palette colors once per frame (see `palettefx_update`)
+// and the result is used when presenting the canvas, so there's no per-pixel work.
+// `CORE->palette_fx` is updated automatically after each `step()`.
+
+#ifndef PUN_PALETTEFX_CYCLES_MAX
+#define PUN_PALETTEFX_CYCLES_MAX (8)
+#endif
+
+typedef struct
+{
+    // Colors from `begin` to `end` (exclusive) are rotated by one every `period` seconds.
+    // Negative `period` rotates the other way.
+    i32 begin;
+    i32 end;
+    f32 period;
+}
+PaletteCycle;
+
+typedef struct
+{
+    // Resulting colors.
+    Color colors[256];
+    f32 time;
+
+    PaletteCycle cycles[PUN_PALETTEFX_CYCLES_MAX];
+    i32 cycles_count;
+
+    Color tint_color;
+    f32 tint_amount;
+
+    Color fade_color;
+    f32 fade_from;
+    f32 fade_to;
+    f32 fade_time;
+    f32 fade_duration;
+
+    Color flash_color;
+    f32 flash_time;
+    f32 flash_duration;
+}
+PaletteFx;
+
+// Removes all effects.
+void palettefx_clear(PaletteFx *fx);
+// Adds cycling of the colors in `range` (see `palette_range_add`) and returns its index.
+int palettefx_cycle_add(PaletteFx *fx, PaletteRange *range, f32 period);
+void palettefx_cycle_remove(PaletteFx *fx, int index);
+// Constantly blends all colors towards `color` by `amount` (0 to 1).
+void palettefx_tint(PaletteFx *fx, Color color, f32 amount);
+// Blends all colors towards `color` changing the amount from `from` to `to` over `duration` seconds.
+// The amount stays at `to` when done, so fade out with `from` = 0 and `to` = 1,
+// and fade in with `from` = 1 and `to` = 0.
+void palettefx_fade(PaletteFx *fx, Color color, f32 from, f32 to, f32 duration);
+// Returns true while fade is in progress.
+bool palettefx_fading(PaletteFx *fx);
+// Blends all colors to `color` and back over `duration` seconds.
+void palettefx_flash(PaletteFx *fx, Color color, f32 duration);
+// Advances the effects by `dt` seconds and evaluates them for `palette` to `fx->colors`.
+void palettefx_update(PaletteFx *fx, Palette *palette, f32 dt);
+
+//
+// Palette snapshots
+//
+
+// Colors presented with a frame. Snapshots are taken from `CORE->palette_fx.colors`
+// after each `step()` and never modified afterwards; a new one is only made when
+// the colors differ from the previous frame (copy-on-write).
+// Presenters and the recorder read the snapshot instead of the live palette,
+// so the palette can be changed freely while a frame is being presented.
+
+#ifndef PUN_PALETTE_SNAPSHOTS
+#define PUN_PALETTE_SNAPSHOTS (3)
+#endif
+
+typedef struct
+{
+    Color colors[256];
+    // Incremented with each new snapshot, so equal versions mean equal colors.
+    u32 version;
+}
+PaletteSnapshot;
 
 
 typedef union
@@ -443,17 +650,37 @@ typedef struct
     i32 palette_range;
     i32 tile_width;
     i32 tile_height;
+    // Animated tiles of the tileset (see `tile_animation_add`).
+    struct TileAnimations_ *animations;
+    // BitmapFormat_*, for packed formats `pitch` is the number of bytes per row.
+    i32 format;
+    // Added to non-zero packed values to get the palette index.
+    u8 base;
 #ifdef PUN_BITMAP_CUSTOM
     PUN_BITMAP_CUSTOM
 #endif
 }
 Bitmap;
 
+enum {
+    // One byte per pixel.
+    BitmapFormat_8 = 0,
+    // Two pixels per byte (low nibble first). Values 1-15 are drawn as `base` + value.
+    BitmapFormat_4,
+    // Eight pixels per byte (lowest bit first). Set bits are drawn as `base` + 1.
+    BitmapFormat_1,
+};
+
 enum {
     DrawFlags_None  = 0,
     DrawFlags_FlipH = 1 << 0,
     DrawFlags_FlipV = 1 << 1,
     DrawFlags_Mask  = 1 << 2,
+    // Draws an outline around the opaque pixels with `Canvas.outline` color.
+    DrawFlags_Outline = 1 << 3,
+    // Draws a silhouette offset by `Canvas.shadow_x` and `Canvas.shadow_y`
+    // below the bitmap with `Canvas.shadow` color.
+    DrawFlags_Shadow  = 1 << 4,
 };
 
 typedef struct
@@ -465,6 +692,12 @@ typedef struct
     Bitmap *font;
     u32 flags;
     u8 mask;
+    // Used with DrawFlags_Outline.
+    u8 outline;
+    // Used with DrawFlags_Shadow.
+    u8 shadow;
+    i32 shadow_x;
+    i32 shadow_y;
 #ifdef PUN_CANVAS_CUSTOM
     PUN_CANVAS_CUSTOM
 #endif
@@ -487,15 +720,60 @@ i32 camera_y();
 // - BITMAP_32, it'll convert it to paletted image by adding the unknown colors to the palette.
 // - BITMAP_8,  the data are copied as they are.
 //
+// With PUNITY_BITMAP_DEDUPE, bitmaps with identical converted pixels share the memory.
+// Their pixels are read-only: don't draw to them (`canvas_push`), clear them or change
+// them in place (initialize with 0 and copy instead).
+//
 void bitmap_init(Bitmap *bitmap, i32 width, i32 height, void *pixels, int type, int palette_range);
 void bitmap_clear(Bitmap *bitmap, u8 color);
 
+#ifndef PUN_BITMAP_REGISTRY_SIZE
+#define PUN_BITMAP_REGISTRY_SIZE (1024)
+#endif
+
+// Pixels shared by bitmaps with the same content (see PUNITY_BITMAP_DEDUPE).
+typedef struct
+{
+    u64 hash;
+    u8 *pixels;
+    u32 size;
+}
+BitmapShared;
+
+// Forgets all shared pixels. Shared pixels above the top of `CORE->storage`
+// are forgotten automatically when it's rewound (`bank_end`, `bank_pop`, `bank_clear`).
+void bitmap_registry_clear();
+
+// Converts 8-bit `source` to `bitmap` with packed `format` (BitmapFormat_*) allocated in `bank`.
+// Non-zero pixels of `source` have to be from `base` + 1 to `base` + 15 for BitmapFormat_4
+// and `base` + 1 for BitmapFormat_1 (set `base` to 0 for masks and fonts).
+// Packed bitmaps can only be drawn, they're expanded to 8-bit rows while drawing.
+void bitmap_pack(Bank *bank, Bitmap *bitmap, Bitmap *source, int format, u8 base);
+// Expands `rect` of the packed `bitmap` to 8-bit palette indices, `rect` width per row.
+void bitmap_unpack(Bitmap *bitmap, Rect rect, u8 *pixels);
+
+enum {
+    Dither_None = 0,
+    // 8x8 Bayer matrix.
+    Dither_Ordered,
+    // Floyd-Steinberg error diffusion, done separately for each band of rows.
+    Dither_Diffuse,
+};
+
+// Same as `bitmap_init` with BITMAP_32 pixels, but only uses colors already in
+// the `palette_range` (never adds new ones). Pixels with no exact match are mapped
+// to the nearest color (see `palette_color_find_nearest`) using `dither` (Dither_*).
+// The image is converted in bands of rows on multiple threads.
+void bitmap_init_dithered(Bitmap *bitmap, i32 width, i32 height, void *pixels, int palette_range, int dither);
+
 // Loads bitmap from an image file.
 // This only works if USE_STB_IMAGE is defined.
 #if PUNITY_USE_STB_IMAGE
 void bitmap_load(Bitmap *bitmap, const char *path, int palette_range);
 void bitmap_load_resource(Bitmap *bitmap, const char *resource_name, int palette_range);
 void bitmap_load_resource_ex(Bank *bank, Bitmap *bitmap, const char *resource_name, int palette_range);
+// Loads the bitmap with `bitmap_init_dithered`.
+void bitmap_load_resource_dithered(Bitmap *bitmap, const char *resource_name, int palette_range, int dither);
 #endif
 
 #if PUNITY_USE_STB_IMAGE
@@ -517,6 +795,24 @@ void clip_reset();
 // Checks clipping rectangle whether it's valid.
 bool clip_check();
 
+#ifndef PUN_CANVAS_STACK_MAX
+#define PUN_CANVAS_STACK_MAX 16
+#endif
+
+// Saves the current canvas (target bitmap, clip, translate, flags and mask)
+// and makes `bitmap` the drawing target with clip set to the whole bitmap,
+// no translation and no flags. The font is kept.
+//
+// Use it to pre-render composites (UI panels, minimaps, backgrounds) to a bitmap
+// once and then draw the bitmap each frame.
+//
+// Items pushed to the draw list capture the current canvas, so items pushed
+// between `canvas_push` and `canvas_pop` are drawn to `bitmap` when the list
+// is drawn. Give them lower z than the items drawing `bitmap` itself.
+void canvas_push(Bitmap *bitmap);
+// Restores the canvas saved by the matching `canvas_push`.
+void canvas_pop();
+
 // Draws a single pixel, sub-optimal, don't use, please.
 void pixel_draw(i32 x, i32 y, u8 color);
 // Draws a line.
@@ -540,8 +836,63 @@ void bitmap_draw_simd_(Bitmap *bitmap, i32 x, i32 y, i32 pivot_x, i32 pivot_y, R
 Rect tile_get(Bitmap *bitmap, i32 index);
 // Draws a tile from bitmap (utilizing Bitmap's tile_width/tile_height).
 void tile_draw(Bitmap *bitmap, i32 index, i32 x, i32 y);
+
+#ifndef PUN_TILE_ANIMATIONS_MAX
+#define PUN_TILE_ANIMATIONS_MAX (64)
+#endif
+
+typedef struct
+{
+    // Tile index in the tileset.
+    i32 index;
+    // In seconds.
+    f32 duration;
+}
+TileFrame;
+
+typedef struct
+{
+    TileFrame *frames;
+    i32 frames_count;
+    f32 duration;
+}
+TileAnimation;
+
+typedef struct TileAnimations_
+{
+    // Animation of each tile in the tileset, -1 if the tile isn't animated.
+    i16 *lookup;
+    i32 tiles_count;
+    TileAnimation items[PUN_TILE_ANIMATIONS_MAX];
+    i32 count;
+    // Tile index of the current frame of each animation at `time`.
+    i32 current[PUN_TILE_ANIMATIONS_MAX];
+    f32 time;
+}
+TileAnimations;
+
+// Animates the tile `index` of the `tileset` (allocated from CORE->storage).
+// Drawing the tile (`tile_draw`, `tilemap_draw`, ...) draws the frame for `CORE->time`,
+// so the tiles in the tilemap don't have to be updated. Chunks of `TileMapCache`s
+// are redrawn. Call `scrollcache_invalidate` each frame if you use a scroll cache
+// for tilemaps with animated tiles.
+void tile_animation_add(Bitmap *tileset, i32 index, TileFrame *frames, i32 frames_count);
+// Returns the tile index to draw for `index` at `CORE->time`.
+i32 tile_animated(Bitmap *tileset, i32 index);
 // Copies bitmap from `source` to `destination`
 void bitmap_copy(Bitmap *destination, Bitmap *source);
+
+enum {
+    ScaleFilter_Nearest = 0,
+    // Scale2x and Scale3x (EPX), other scales fall back to nearest.
+    ScaleFilter_EPX,
+};
+
+// Scales `source` by an integer `scale` to `destination` using `filter` (ScaleFilter_*).
+// The `destination` has to be exactly `scale` times larger than `source`.
+void bitmap_scale(Bitmap *destination, Bitmap *source, i32 scale, int filter);
+// Same as `bitmap_scale`, but only scales `source` rows from `min_y` to `max_y`.
+void bitmap_scale_rows(Bitmap *destination, Bitmap *source, i32 scale, int filter, i32 min_y, i32 max_y);
 // Calculates width and height of the text using current font.
 void text_measure(const char *text, i32 *w, i32 *h);
 // Draws text to the canvas.
@@ -650,6 +1001,59 @@ DrawListItem *rect_draw_push(Rect rect, u8 color, i32 z);
 DrawListItem *line_draw_push(i32 x1, i32 y1, i32 x2, i32 y2, u8 color, i32 z);
 DrawListItem *tile_draw_push(Bitmap *bitmap, i32 x, i32 y, i32 index, i32 z);
 
+//
+// Atlas
+//
+
+// Packs many small bitmaps to shared pages (skyline bottom-left packing).
+// Regions are drawn as parts of the page, so bitmaps that are drawn together
+// share memory and the draw list items point to the same page bitmap.
+// Pages are allocated in CORE->storage when needed.
+
+#ifndef PUN_ATLAS_PAGES_MAX
+#define PUN_ATLAS_PAGES_MAX (16)
+#endif
+
+typedef struct
+{
+    Bitmap *page;
+    Rect rect;
+}
+AtlasRegion;
+
+typedef struct
+{
+    i32 x;
+    i32 y;
+    i32 width;
+}
+AtlasNode;
+
+typedef struct
+{
+    i32 page_width;
+    i32 page_height;
+    Bitmap *pages[PUN_ATLAS_PAGES_MAX];
+    // Skyline of each page, sorted by `x`.
+    AtlasNode *nodes[PUN_ATLAS_PAGES_MAX];
+    i32 nodes_count[PUN_ATLAS_PAGES_MAX];
+    i32 pages_count;
+}
+Atlas;
+
+void atlas_init(Atlas *atlas, i32 page_width, i32 page_height);
+// Finds a free `width` x `height` rect in one of the pages.
+// Returns false if it's larger than the page or there are no more pages.
+bool atlas_reserve(Atlas *atlas, i32 width, i32 height, AtlasRegion *region);
+// Copies the `bitmap` pixels to the atlas.
+bool atlas_add(Atlas *atlas, Bitmap *bitmap, AtlasRegion *region);
+#if PUNITY_USE_STB_IMAGE
+// Same as `bitmap_load_resource`, but the pixels are stored to the atlas.
+bool atlas_add_resource(Atlas *atlas, const char *resource_name, int palette_range, AtlasRegion *region);
+#endif
+void atlas_region_draw(AtlasRegion *region, i32 x, i32 y, i32 pivot_x, i32 pivot_y);
+DrawListItem *atlas_region_draw_push(AtlasRegion *region, i32 x, i32 y, i32 pivot_x, i32 pivot_y, i32 z);
+
 //
 // Debug
 //
@@ -688,6 +1092,52 @@ void sound_load(Sound *sound, const char *path);
 void sound_load_resource(Sound *sound, const char *resource_name);
 #endif
 
+//
+// Present
+//
+
+// Converts `count` palette indices from `src` to 32-bit colors in `dst`.
+void palette_expand(u32 *dst, u8 *src, size_t count, const Color *colors);
+
+// Converts the 8-bit canvas to 32-bit pixels for the runtime to upload.
+// Only rows that changed since the last update are converted.
+// The canvas can be optionally upscaled (see `bitmap_scale`) before conversion.
+typedef struct
+{
+    // Converted pixels (`pixels_width` * `pixels_height`).
+    u32 *pixels;
+    i32 pixels_width;
+    i32 pixels_height;
+    // Copy of the canvas from the last update used to find changed rows.
+    u8 *shadow;
+    // Colors used in the last update.
+    Color colors[256];
+    // Canvas size.
+    i32 width;
+    i32 height;
+    // Integer scale and ScaleFilter_* applied to the canvas.
+    i32 scale;
+    int filter;
+    // Scaled canvas, only used when `scale` is greater than 1.
+    Bitmap scaled;
+    // Stores rows bottom-up (as Windows DIBs and OpenGL textures want them).
+    b32 flip;
+    // Forces all rows to be converted in the next update.
+    b32 invalid;
+    // Range of `pixels` rows changed by the last update.
+    // Empty (min == max) if nothing has changed.
+    i32 dirty_min_y;
+    i32 dirty_max_y;
+}
+Present;
+
+void present_init(Present *P, Bank *bank, i32 width, i32 height, i32 scale, int filter, bool flip);
+// Marks all rows to be converted in the next update.
+void present_invalidate(Present *P);
+// Converts the changed rows of `canvas` using `colors`.
+// Returns true if any of the rows has changed.
+bool present_update(Present *P, Bitmap *canvas, const Color *colors);
+
 //
 // Windowing
 //
@@ -702,6 +1152,220 @@ void window_fullscreen_toggle();
 
 void *resource_get(const char *name, size_t *size);
 
+//
+// Packs
+//
+
+// Pack is a single binary file with assets baked by `punity-bake.c`:
+// bitmaps already converted to palette indices, PCM or compressed sounds,
+// raw resources and the palette (colors and ranges) the bitmaps were baked with.
+// The file is memory mapped and used in place, so loading an asset
+// is a hash lookup that points the Bitmap or Sound to the mapped data.
+// Mapping is copy-on-write, so writing to the pixels doesn't change the file.
+//
+// Layout (all offsets are from the beginning of the pack):
+// PackHeader | index (u32 * index_count) | PackEntry * entries_count | names | PackPalette | data
+// Each data block is aligned to PUN_PACK_ALIGN bytes.
+
+#define PUN_PACK_MAGIC   (0x4B505550) // "PUPK"
+#define PUN_PACK_VERSION (1)
+#define PUN_PACK_ALIGN   (16)
+
+enum
+{
+    // Resource stored as is (e.g. OGG or JSON file).
+    PackEntry_Raw    = 0,
+    // Bitmap with palette indices (`pitch` * `height` bytes, rows are `width` apart as in Bitmap).
+    PackEntry_Bitmap = 1,
+    // Interleaved 16-bit PCM samples.
+    PackEntry_Sound  = 2,
+};
+
+typedef struct
+{
+    u32 magic;
+    u32 version;
+    // Size of the whole pack in bytes.
+    u32 size;
+    u32 entries_count;
+    u32 entries_offset;
+    // Open addressed index of entries by name hash, power of two.
+    // Each slot is an entry index + 1, 0 is an empty slot.
+    u32 index_count;
+    u32 index_offset;
+    // 0 if the pack has no palette.
+    u32 palette_offset;
+}
+PackHeader;
+
+typedef struct
+{
+    // `pack_hash` of the name.
+    u32 hash;
+    u32 type;
+    // Zero terminated.
+    u32 name_offset;
+    u32 data_offset;
+    u32 data_size;
+    union {
+        struct {
+            i32 width;
+            i32 height;
+            i32 pitch;
+            i32 palette_range;
+            i32 tile_width;
+            i32 tile_height;
+        } bitmap;
+        struct {
+            i32 channels;
+            u32 rate;
+            // Samples per channel.
+            u32 samples_count;
+        } sound;
+        u32 params[6];
+    };
+}
+PackEntry;
+
+typedef struct
+{
+    i32 begin;
+    i32 end;
+    i32 it;
+}
+PackPaletteRange;
+
+typedef struct
+{
+    Color colors[256];
+    // Followed by `ranges_count` PackPaletteRange structs.
+    i32 ranges_count;
+}
+PackPalette;
+
+typedef struct
+{
+    u8 *data;
+    size_t size;
+    PackHeader *header;
+    PackEntry *entries;
+    u32 *index;
+    // Platform handles, 0 if the pack was opened from memory.
+    void *file_;
+    void *mapping_;
+}
+Pack;
+
+// FNV-1a hash of the entry name.
+u32 pack_hash(const char *name);
+// Maps the pack file to memory. Returns false if it's not a valid pack.
+bool pack_open(Pack *pack, const char *path);
+// Uses the pack in `data` in place (e.g. embedded in the executable).
+bool pack_open_memory(Pack *pack, void *data, size_t size);
+void pack_close(Pack *pack);
+// Returns the entry or 0 if there's no entry with the `name` or the pack isn't open.
+PackEntry *pack_find(Pack *pack, const char *name);
+// Returns the data of the entry with the `name` (of any type) or 0 (`size` is set to 0).
+void *pack_resource_get(Pack *pack, const char *name, size_t *size);
+// Replaces `palette` colors and ranges with the ones the pack was baked with.
+// Has to be used before drawing any of the pack's bitmaps.
+bool pack_palette_load(Pack *pack, Palette *palette);
+// Points `bitmap` to the pixels in the pack.
+bool pack_bitmap_load(Pack *pack, Bitmap *bitmap, const char *name);
+// Points `sound` to the samples in the pack.
+// Raw entries are decoded to CORE->storage (if PUNITY_USE_STB_VORBIS is enabled).
+bool pack_sound_load(Pack *pack, Sound *sound, const char *name);
+
+#if PUNITY_RESOURCES_EMBEDDED
+extern const u8 punity_resources[];
+extern const size_t punity_resources_size;
+#endif
+
+//
+// Loader
+//
+
+// Loads bitmaps and sounds from resources on multiple threads:
+//
+//     Loader *loader = bank_push_t(CORE->storage, Loader, 1);
+//     loader_begin(loader);
+//     loader_bitmap(loader, &GAME->tileset, "tileset.png", 0);
+//     loader_sound(loader, &GAME->jump, "jump.ogg");
+//     loader_start(loader);
+//     loader_wait(loader);
+//
+// Resources are decoded in batches on the `parallel_for` threads, sounds to
+// a scratch bank of each worker. The results are converted and copied to
+// CORE->storage on the calling thread in the order they were added, so the
+// palette and storage end up the same as with `bitmap_load_resource` and
+// `sound_load_resource` called in that order.
+// Instead of `loader_wait`, `loader_update` can be called every frame to show progress.
+
+#ifndef PUN_LOADER_JOBS_MAX
+#define PUN_LOADER_JOBS_MAX (256)
+#endif
+
+// Address space reserved for the scratch bank of each worker.
+#ifndef PUN_LOADER_BANK_CAPACITY
+#define PUN_LOADER_BANK_CAPACITY (megabytes(64))
+#endif
+
+enum
+{
+    LoaderJob_Bitmap,
+    LoaderJob_Font,
+    LoaderJob_Sound,
+};
+
+typedef struct
+{
+    int type;
+    const char *name;
+    void *resource;
+    size_t resource_size;
+    Bitmap *bitmap;
+    Sound *sound;
+    i32 palette_range;
+    i32 tile_width;
+    i32 tile_height;
+    // Set by the worker.
+    // Bitmap: 32-bit pixels of `width` * `height` size (from stb_image).
+    // Sound: samples described by `decoded_sound` (in the worker's bank).
+    void *decoded;
+    i32 width;
+    i32 height;
+    Sound decoded_sound;
+}
+LoaderJob;
+
+typedef struct
+{
+    LoaderJob jobs[PUN_LOADER_JOBS_MAX];
+    i32 jobs_count;
+    // Number of jobs already copied to storage.
+    i32 committed;
+    // Scratch bank of each `parallel_for` worker, cleared after each batch.
+    Bank banks[PUN_THREADS_MAX];
+    i32 banks_count;
+    b32 started;
+}
+Loader;
+
+void loader_begin(Loader *loader);
+// Same as `bitmap_load_resource`.
+void loader_bitmap(Loader *loader, Bitmap *bitmap, const char *resource_name, int palette_range);
+// Same as `font_load_resource`.
+void loader_font(Loader *loader, Bitmap *font, const char *resource_name, i32 tile_width, i32 tile_height);
+// Same as `sound_load_resource`.
+void loader_sound(Loader *loader, Sound *sound, const char *resource_name);
+// Reserves the scratch banks, no more jobs can be added after this.
+void loader_start(Loader *loader);
+// Decodes the next `cpu_count()` resources, copies them to storage (in order)
+// and returns progress from 0 to 1.
+f32 loader_update(Loader *loader);
+// Decodes all remaining resources and copies them to storage.
+void loader_wait(Loader *loader);
+
 //
 // GIF recording.
 //
@@ -716,7 +1380,8 @@ void *resource_get(const char *name, size_t *size);
 typedef struct RecorderFrame_
 {
     uint8_t *pixels;
-    GIFWColorTable color_table;
+    // Shared by consecutive frames with the same palette snapshot.
+    GIFWColorTable *color_table;
 }
 RecorderFrame;
 
@@ -732,8 +1397,20 @@ RecorderFrameBlock;
 typedef struct Recorder_ {
     bool active;
     Deque frames;
+    // Color tables, a new one is only added when the palette snapshot changes.
+    Deque color_tables;
+    GIFWColorTable *color_table;
+    u32 color_table_version;
+    // First color table, written as the global one.
+    GIFWColorTable *color_table_global;
     GIFW gif;
     size_t frames_count;
+    // Integer scale and ScaleFilter_* applied when writing the GIF.
+    // Frames are always recorded at 1x, 0 is the same as 1.
+    i32 scale;
+    int filter;
+    // Scaled frame used while writing.
+    Bitmap scaled;
 } Recorder;
 
 #endif // PUNITY_FEATURE_RECORDER
@@ -742,10 +1419,16 @@ void record_begin();
 void record_end();
 void record_toggle();
 
+// Saves current canvas to a GIF file scaled by `scale` using `filter` (ScaleFilter_*).
+// Returns false if the file can't be written or if PUNITY_FEATURE_RECORDER is disabled.
+bool screenshot_save(const char *path, i32 scale, int filter);
+
 //
 // Spatial Hash
 //
 
+// Items assigned to a cell of the spatial hash.
+// Cells with the same `x` and `y` are linked with `next`.
 typedef struct SpatialCell_
 {
     void *items[16];
@@ -755,29 +1438,69 @@ typedef struct SpatialCell_
 }
 SpatialCell;
 
+// Slot of the open-addressed table, `cell` is 0 for empty slots.
+typedef struct SpatialSlot_
+{
+    i32 x, y;
+    SpatialCell *cell;
+}
+SpatialSlot;
+
+// Open-addressed (linear probing) table with power of two number of slots
+// mapping cell coordinates to cells. Grows when more than
+// PUN_SPATIALHASH_LOAD percent of the slots is used.
+//
+// With `spatialhash_init_grid` cells inside `grid_rect` are indexed directly
+// in a dense grid and only cells outside of it go to the table.
 typedef struct SpatialHash_
 {
     Deque cells;
-    size_t buckets_count;
-    SpatialCell **buckets;
+    size_t slots_count;
+    size_t slots_used;
+    // 32 - log2(slots_count).
+    u32 slots_shift;
+    SpatialSlot *slots;
     Rect rect;
 
+    // First cell for each cell of `grid_rect`, row by row.
+    SpatialCell **grid;
+    Rect grid_rect;
+
     SpatialCell *pool;
 }
 SpatialHash;
 
+#ifndef PUN_SPATIALHASH_LOAD
+#define PUN_SPATIALHASH_LOAD (50)
+#endif
+
+// Mixes both coordinates, so that grid-aligned cells don't cluster in the table.
+// Top bits of the result are used as the slot index (Fibonacci hashing).
+static inline u32
+spatialhash_hash_(i32 x, i32 y)
+{
+    return (((u32)x * 0x9E3779B1u) ^ (u32)y) * 0x85EBCA6Bu;
+}
+
 #ifndef spatialhash_hash
-#define spatialhash_hash(X, Y) ((u32)(7*(X) + 3*(Y)))
+#define spatialhash_hash(X, Y) spatialhash_hash_((X), (Y))
 #endif
 
 #ifndef spatialhash_bucket
-#define spatialhash_bucket(H, Hash) ((size_t)((Hash) % ((H)->buckets_count)))
+#define spatialhash_bucket(H, Hash) ((size_t)((u32)(Hash) >> (H)->slots_shift))
 #endif
 
 
-// Initializes the spatial hash with given `buckets_count`.
+// Initializes the spatial hash with `buckets_count` slots (rounded up to
+// a power of two), the table grows as needed.
 void spatialhash_init(SpatialHash *H, size_t buckets_count);
 
+// Same as `spatialhash_init`, but cells in `grid_rect` are stored in a dense grid.
+// Use for bounded worlds, the table is only used for cells outside of the bounds.
+// Grid cells are the same linked `SpatialCell`s, so items of a cell are contiguous
+// up to 16 items.
+void spatialhash_init_grid(SpatialHash *H, size_t buckets_count, Rect grid_rect);
+
 // Frees the spatial hash.
 void spatialhash_free(SpatialHash *H);
 
@@ -791,6 +1514,7 @@ void spatialhash_add(SpatialHash *H, Rect range, void *item);
 void spatialhash_remove(SpatialHash *H, Rect range, void *item);
 
 // Changes the rectangle of the item from `old_range` to `new_range`.
+// Only cells that are in one of the ranges but not the other are updated.
 void spatialhash_update(SpatialHash *H, void *item, Rect old_range, Rect new_range);
 
 // Returns a cell at given `x`, `y`. If no cell is available at that location, returns NULL.
@@ -799,10 +1523,11 @@ void spatialhash_update(SpatialHash *H, void *item, Rect old_range, Rect new_ran
 // You can iterate over the cells and items like this:
 /*
     cell = spatialhash_get_cell(H, 13, 37);
-    while (cell & (cell->x == 13 && cell->y == 37)) {
+    while (cell && (cell->x == 13 && cell->y == 37)) {
         for (int i = 0; i != cell->items_count; ++i) {
             Do something with `cell->items[i]`.
         }
+        cell = cell->next;
     }
 */
 SpatialCell *spatialhash_get_cell(SpatialHash *H, int x, int y);
@@ -811,8 +1536,17 @@ SpatialCell *spatialhash_get_cell(SpatialHash *H, int x, int y);
 // Tilemap
 //
 
+// Tile graphics referenced by the compact tilemap layout (see `tilemap_compact`).
+typedef struct
+{
+    Bitmap *tileset;
+    i32 index;
+}
+TileDef;
+
 typedef struct
 {
+    // Same as `TileDef`.
     Bitmap *tileset;
     i32 index;
     // Used by collision system.
@@ -828,11 +1562,29 @@ Tile;
 
 typedef struct
 {
+    // Null with the compact layout.
     Tile *tiles;
     i32 width;
     i32 height;
     i32 tile_width;
     i32 tile_height;
+    // Invalidated by `tilemap_tile_set` (see `tilemapcache_init`).
+    struct TileMapCache_ *cache;
+
+    // Compact layout, each cell is an index to `defs` (0 is an empty tile),
+    // lowest 8 bits of `Tile.flags` and `Tile.layer` stored in separate planes.
+    u16 *ids;
+    u8 *edges;
+    u8 *layers;
+    TileDef *defs;
+    i32 defs_count;
+    i32 defs_max;
+
+    // Bitsets of tiles with each `Edge_*` flag (see `tilemap_solid_build`).
+    // Edge_Left and Edge_Right are stored by rows, Edge_Top and Edge_Bottom by columns.
+    u64 *solid[4];
+    // Bitset rows of tiles without transparent pixels (see `tilemap_opaque_build`).
+    u64 *opaque;
 #ifdef PUN_TILEMAP_CUSTOM
     PUN_TILEMAP_CUSTOM
 #endif
@@ -840,8 +1592,151 @@ typedef struct
 TileMap;
 
 void tilemap_init(TileMap *tilemap, i32 width, i32 height, i32 tile_width, i32 tile_height);
+// Initializes the tilemap with the compact layout (4 bytes per tile) that can use up to `defs_max` distinct tiles.
+// `PUN_TILE_CUSTOM` fields, `Tile.flags` above 8 bits and `Tile.layer` above 8 bits are not stored.
+void tilemap_init_compact(TileMap *tilemap, i32 width, i32 height, i32 tile_width, i32 tile_height, i32 defs_max);
+// Converts `tiles` to the compact layout (planes are allocated from CORE->storage).
+// The `tiles` memory isn't given back, to build a big map without it use
+// `tilemap_init_compact` and `tilemap_tile_set`.
+void tilemap_compact(TileMap *tilemap);
+// Returns index of `tileset` and `index` in compact tilemap `defs`, adds it if it's not there.
+u16 tilemap_def_acquire(TileMap *tilemap, Bitmap *tileset, i32 index);
 bool tilemap_get_draw_range(TileMap *tilemap, Rect *range);
 void tilemap_draw(TileMap *tilemap);
+// Points tiles with identical pixels (even from different tilesets) to the same tileset and index,
+// so fewer distinct tiles are drawn. Collision `flags` and `layer` of the tiles are kept.
+void tilemap_dedupe(TileMap *tilemap);
+// Sets the tile at `x`, `y` and invalidates the cached chunk (if there's a cache).
+void tilemap_tile_set(TileMap *tilemap, i32 x, i32 y, Tile *tile);
+// Gets the tile at `x`, `y` (works with both layouts).
+Tile tilemap_tile_get(TileMap *tilemap, i32 x, i32 y);
+// Builds the `solid` bitsets (allocated from CORE->storage), the scene collision
+// sweeps then skip 64 empty tiles at a time. `tilemap_tile_set` keeps them updated,
+// call it again if you change the tiles directly.
+void tilemap_solid_build(TileMap *tilemap);
+// Returns the first tile with `edge` flag and `layer & mask` going from `from` towards `to` (exclusive),
+// -1 if there's none. Searches columns of row `line` for Edge_Left and Edge_Right,
+// rows of column `line` for Edge_Top and Edge_Bottom.
+i32 tilemap_solid_find(TileMap *tilemap, i32 edge, i32 line, i32 from, i32 to, i32 mask);
+
+//
+// Tilemap cache
+//
+
+// Number of tiles in each direction of a cached chunk.
+#ifndef PUN_TILEMAP_CHUNK_TILES
+#define PUN_TILEMAP_CHUNK_TILES (16)
+#endif
+
+// Number of chunk bitmaps kept by the cache.
+#ifndef PUN_TILEMAP_CHUNKS_MAX
+#define PUN_TILEMAP_CHUNKS_MAX (16)
+#endif
+
+// Keeps chunks of the tilemap drawn into bitmaps, so static tilemaps are drawn
+// with a few large blits instead of one blit per tile. A chunk is drawn when it
+// gets visible and its bitmap is reused for another chunk when it wasn't drawn
+// for the longest time.
+//
+// Tiles are clipped to their chunk, so tiles larger than the tilemap tile size
+// might get cut. Change tiles with `tilemap_tile_set` or call `tilemapcache_invalidate`
+// if you change `tilemap->tiles` directly.
+//
+// Animated tiles (see `tile_animation_add`) are left out of the chunks
+// and drawn over them each frame. Adding an animation redraws all chunks.
+typedef struct TileMapCache_
+{
+    TileMap *tilemap;
+    Bitmap chunks[PUN_TILEMAP_CHUNKS_MAX];
+    i32 chunks_count;
+    // Index of the chunk in `slots` each bitmap has, -1 if none.
+    i32 chunks_index[PUN_TILEMAP_CHUNKS_MAX];
+    // Value of `draws` when the chunk was drawn the last time.
+    u32 chunks_used[PUN_TILEMAP_CHUNKS_MAX];
+    // Number of animated tiles left out of the chunk.
+    i32 chunks_animated[PUN_TILEMAP_CHUNKS_MAX];
+    // Bitmap in `chunks` for each chunk of the tilemap, -1 if not cached.
+    i16 *slots;
+    // Size of the tilemap in chunks.
+    i32 width;
+    i32 height;
+    u32 draws;
+    // Number of tile animations added when the chunks were drawn.
+    u32 animations_version;
+}
+TileMapCache;
+
+// Allocates the cache from CORE->storage and attaches it to the `tilemap`.
+void tilemapcache_init(TileMapCache *cache, TileMap *tilemap);
+// Redraws chunks touching the `range` of tiles the next time they're visible.
+void tilemapcache_invalidate(TileMapCache *cache, Rect range);
+// Same as `tilemap_draw`, but draws visible chunks from the cache.
+void tilemapcache_draw(TileMapCache *cache);
+
+//
+// Tilemap layers
+//
+
+typedef struct
+{
+    TileMap *tilemap;
+    // Optional, the layer is drawn from the cache if set.
+    TileMapCache *cache;
+    // How much the layer moves with the camera (canvas translation),
+    // 1 moves with the camera, 0.5 is a far background, 0 doesn't move.
+    f32 scroll_x;
+    f32 scroll_y;
+    // Offset of the layer in pixels.
+    i32 x;
+    i32 y;
+    i32 z;
+}
+TileMapLayer;
+
+// Builds the `opaque` bitset (allocated from CORE->storage) used to skip layers
+// hidden behind this tilemap. `tilemap_tile_set` keeps it updated.
+void tilemap_opaque_build(TileMap *tilemap);
+// Pushes one draw list item per visible layer, translated by the layer scroll and offset.
+// Layers with lower `z` than a layer that covers the whole canvas clip with opaque
+// tiles (see `tilemap_opaque_build`) are not pushed.
+void tilemap_layers_draw_push(TileMapLayer *layers, i32 count);
+
+//
+// Scroll cache
+//
+
+// Keeps the background drawn in the previous frame, so when the camera moves
+// only by a few pixels, the cached background is shifted in place and only
+// the newly exposed strips are drawn.
+//
+// The cache covers the whole canvas bitmap and assumes the background only
+// depends on the canvas translation (see `camera_set`). Call `scrollcache_invalidate`
+// when the background changes in any other way (a tile is changed, palette
+// animation, etc.)
+typedef struct
+{
+    Bitmap bitmap;
+    // Canvas translation the `bitmap` was drawn with.
+    i32 translate_x;
+    i32 translate_y;
+    b32 valid;
+}
+ScrollCache;
+
+// Called to draw the background. The canvas is pushed (see `canvas_push`) with
+// the translation of the current canvas and clip set to the strip to draw.
+// All pixels within the clip have to be drawn.
+#define SCROLLCACHE_CALLBACK(name) void name(void *user)
+typedef SCROLLCACHE_CALLBACK(ScrollCacheCallbackF);
+
+// Allocates the cache bitmap from CORE->storage.
+void scrollcache_init(ScrollCache *cache, i32 width, i32 height);
+// Forces the whole background to be redrawn by the next `scrollcache_draw`.
+void scrollcache_invalidate(ScrollCache *cache);
+// Updates the cache for current canvas translation and copies it to the canvas (within canvas clip).
+void scrollcache_draw(ScrollCache *cache, ScrollCacheCallbackF *callback, void *user);
+// Same as `scrollcache_draw`, but draws the `tilemap` over `background` color.
+void scrollcache_draw_tilemap(ScrollCache *cache, TileMap *tilemap, u8 background);
 
 
 
@@ -865,6 +1760,10 @@ typedef struct SceneEntity_ {
     i32 flags;
     f32 rx, ry;
     void *next;
+    // Value of `Scene.query` of the last query that reported the entity.
+    u32 query;
+    // Index in `Scene.sorted`.
+    i32 sorted_index;
 #ifdef PUN_SCENE_ENTITY_CUSTOM
     PUN_SCENE_ENTITY_CUSTOM
 #endif
@@ -880,6 +1779,7 @@ typedef struct SceneItem_ {
     i32 type;
     union {
         SceneEntity *entity;
+        // With compact tilemap layout it's a copy of the tile valid until the next scene query.
         Tile *tile;
         void *ptr;
     };
@@ -922,19 +1822,47 @@ typedef struct Scene_
     i32 entities_count;
     i32 cell_size;
     SpatialHash hash;
+    // Incremented for each query, so that entities in multiple cells are reported once.
+    u32 query;
+    // Entities sorted by `box.min_x` for `scene_overlaps_all`, kept between calls.
+    SceneEntity **sorted;
+    i32 sorted_count;
+    i32 sorted_max;
 
     Collision collision;
+    // Tile reported to callbacks with compact tilemap layout.
+    Tile tile_copy;
 }
 Scene;
 
 // Initializes the world.
 void scene_init(Scene *scene, i32 cell_size);
+// Initializes the world with a dense grid broadphase covering `bounds` (in pixels),
+// for example `rect_make_size(0, 0, tilemap->width * tilemap->tile_width, tilemap->height * tilemap->tile_height)`.
+// Entities are still allowed outside of the bounds, but they're hashed.
+void scene_init_grid(Scene *scene, i32 cell_size, Rect bounds);
 
 // Iterates over all entities and tiles in given `rect`.
+// Each entity is reported once, even if it spans multiple cells.
+// Entities might be reported again if the callback runs another query on the same scene.
 #define SCENE_FOREACH_CALLBACK(name) bool name(Scene *scene, Rect *cast_box, Rect *item_box, i32 item_flags, SceneItem *item, void *data)
 typedef SCENE_FOREACH_CALLBACK(SceneForEachCallbackF);
 bool scene_foreach(Scene *scene, Rect rect, SceneForEachCallbackF *callback, void *data, i32 mask);
 
+// Calls `callback` once for each pair of entities with overlapping boxes (touching boxes
+// don't overlap) where the mask of one of them matches the layer of the other.
+// Entities are kept sorted by `box.min_x` between calls, so the order is updated
+// with an insertion sort, which is cheap when entities move a little each frame.
+// Return true from the callback to stop. Don't add or remove entities in the callback.
+#define SCENE_OVERLAP_CALLBACK(name) bool name(Scene *scene, SceneEntity *a, SceneEntity *b, void *data)
+typedef SCENE_OVERLAP_CALLBACK(SceneOverlapCallbackF);
+bool scene_overlaps_all(Scene *scene, SceneOverlapCallbackF *callback, void *data);
+
+// Fills `items` with entities in `mask` layers overlapping the `rect` (see `rect_overlaps`),
+// each entity once. Returns number of entities found, which can be more than `items_max`
+// (only first `items_max` are stored then).
+i32 scene_query(Scene *scene, Rect rect, i32 mask, SceneItem *items, i32 items_max);
+
 void scene_debug_tilemap(Scene *scene, u8 color, i32 z);
 void scene_debug_cells(Scene *scene, u8 color, i32 z);
 
@@ -955,6 +1883,10 @@ typedef struct Window_
     int width;
     int height;
     f32 scale;
+    // ScaleFilter_* used to upscale the canvas before it's handed to the window.
+    // With ScaleFilter_EPX the canvas is upscaled 2x or 3x (depending on `scale`),
+    // the rest of the scaling is left to the window.
+    int filter;
 
     f32 viewport_min_x;
     f32 viewport_min_y;
@@ -1041,9 +1973,29 @@ typedef struct
     Color background;
 
     Canvas canvas;
+    // Canvases saved by `canvas_push`.
+    Canvas canvas_stack[PUN_CANVAS_STACK_MAX];
+    i32 canvas_stack_count;
     Palette *palette;
+    // Palette effects, `palette_fx.colors` are the colors used to present the canvas.
+    PaletteFx palette_fx;
+    // Snapshot of `palette_fx.colors` for the last frame.
+    // A snapshot stays valid until PUN_PALETTE_SNAPSHOTS - 1 more palette changes.
+    const PaletteSnapshot *palette_snapshot;
+    // True if the last frame has a different palette than the one before.
+    b32 palette_snapshot_changed;
+    PaletteSnapshot palette_snapshots[PUN_PALETTE_SNAPSHOTS];
     DrawList *draw_list;
 
+    // Open addressed by hash, see PUNITY_BITMAP_DEDUPE.
+    BitmapShared bitmap_registry[PUN_BITMAP_REGISTRY_SIZE];
+    i32 bitmap_registry_count;
+    // End of the highest shared pixels in `storage`.
+    u8 *bitmap_registry_top;
+
+    // Used by `resource_get` with PUNITY_RESOURCES_PACK.
+    Pack resources;
+
     f32 audio_volume;
 
     // Data for shader.
@@ -1225,6 +2177,11 @@ extern KeyMapping KEY_MAPPING[];
 
 #if PUN_PLATFORM_OSX || PUN_PLATFORM_LINUX
 // TODO
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #else
 
 #define _WINSOCKAPI_
@@ -1262,6 +2219,10 @@ extern KeyMapping KEY_MAPPING[];
 #include <tmmintrin.h>
 #endif
 
+#if PUNITY_SIMD_AVX2
+#include <immintrin.h>
+#endif
+
 #define PUNP_SOUND_DEFAULT_SOUND_VOLUME 0.9f
 #define PUNP_SOUND_DEFAULT_MASTER_VOLUME 0.9f
 
@@ -1292,7 +2253,7 @@ panic_(const char *message, const char *expression, const char *function, const
     char *e_it = e;
     char *e_end = e + array_count(e) - 2;
     // expression = "hello %f world";
-    while (e_it < e_end && expression) {
+    while (e_it < e_end && expression && *expression) {
         if (*expression == '%') {
             *e_it++ = '%';
         }
@@ -1356,6 +2317,7 @@ struct
     __m128i mm_FF;
     __m128i mm_flip;
     __m128i masks[16];
+    __m128i scale3[3];
 }
 simd__ = {0};
 
@@ -1382,6 +2344,11 @@ simd_init__()
     simd__.masks[15] = _mm_srli_si128(simd__.mm_FF,  1);
 
     simd__.mm_flip = _mm_set_epi64x(0x0001020304050607, 0x08090a0b0c0d0e0f);
+
+    // Spreads 16 pixels to 48 for nearest scaling by 3.
+    simd__.scale3[0] = _mm_setr_epi8( 0,  0,  0,  1,  1,  1,  2,  2,  2,  3,  3,  3,  4,  4,  4,  5);
+    simd__.scale3[1] = _mm_setr_epi8( 5,  5,  6,  6,  6,  7,  7,  7,  8,  8,  8,  9,  9,  9, 10, 10);
+    simd__.scale3[2] = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
 }
 #endif
 
@@ -1470,16 +2437,269 @@ perf_get()
 }
 
 //
-// Memory
+// Threads
 //
 
-void *
-virtual_reserve(void *ptr, u32 size)
-{
 #if PUN_PLATFORM_WINDOWS
-    ptr = VirtualAlloc(ptr, size, MEM_RESERVE, PAGE_NOACCESS);
-    ASSERT(ptr);
-#else
+static DWORD WINAPI
+thread_proc_(LPVOID param)
+{
+    Thread *thread = (Thread*)param;
+    thread->proc(thread->user);
+    return 0;
+}
+#else
+static void *
+thread_proc_(void *param)
+{
+    Thread *thread = (Thread*)param;
+    thread->proc(thread->user);
+    return 0;
+}
+#endif
+
+bool
+thread_start(Thread *thread, ThreadProcF *proc, void *user)
+{
+    thread->proc = proc;
+    thread->user = user;
+#if PUN_PLATFORM_WINDOWS
+    HANDLE handle = CreateThread(0, 0, thread_proc_, thread, 0, 0);
+    thread->handle = (u64)(uintptr_t)handle;
+    return handle != 0;
+#else
+    pthread_t handle;
+    if (pthread_create(&handle, 0, thread_proc_, thread) != 0) {
+        return false;
+    }
+    thread->handle = (u64)(uintptr_t)handle;
+    return true;
+#endif
+}
+
+void
+thread_join(Thread *thread)
+{
+#if PUN_PLATFORM_WINDOWS
+    WaitForSingleObject((HANDLE)(uintptr_t)thread->handle, INFINITE);
+    CloseHandle((HANDLE)(uintptr_t)thread->handle);
+#else
+    pthread_join((pthread_t)(uintptr_t)thread->handle, 0);
+#endif
+    thread->handle = 0;
+}
+
+i32
+cpu_count()
+{
+    static i32 count = 0;
+    if (count == 0) {
+#if PUN_PLATFORM_WINDOWS
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        count = (i32)info.dwNumberOfProcessors;
+#else
+        count = (i32)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        count = clamp(count, 1, PUN_THREADS_MAX);
+    }
+    return count;
+}
+
+i32
+atomic_add(volatile i32 *target, i32 value)
+{
+#if PUN_PLATFORM_WINDOWS
+    return (i32)InterlockedExchangeAdd((volatile LONG*)target, value) + value;
+#else
+    return __sync_add_and_fetch(target, value);
+#endif
+}
+
+typedef struct
+{
+    ParallelForProcF *proc;
+    void *user;
+    i32 count;
+    i32 grain;
+    volatile i32 next;
+}
+ParallelFor_;
+
+typedef struct
+{
+    ParallelFor_ *job;
+    i32 worker;
+}
+ParallelForWorker_;
+
+static THREAD_PROC(parallel_for_worker_)
+{
+    ParallelForWorker_ *worker = (ParallelForWorker_*)user;
+    ParallelFor_ *job = worker->job;
+    i32 begin;
+    for (;;) {
+        begin = atomic_add(&job->next, job->grain) - job->grain;
+        if (begin >= job->count) {
+            break;
+        }
+        job->proc(job->user, begin, minimum(begin + job->grain, job->count), worker->worker);
+    }
+}
+
+typedef struct
+{
+#if PUN_PLATFORM_WINDOWS
+    HANDLE handle;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    i32 count;
+#endif
+}
+Semaphore_;
+
+static void
+semaphore_init_(Semaphore_ *semaphore)
+{
+#if PUN_PLATFORM_WINDOWS
+    semaphore->handle = CreateSemaphoreA(0, 0, PUN_THREADS_MAX, 0);
+#else
+    pthread_mutex_init(&semaphore->mutex, 0);
+    pthread_cond_init(&semaphore->cond, 0);
+    semaphore->count = 0;
+#endif
+}
+
+static void
+semaphore_post_(Semaphore_ *semaphore, i32 count)
+{
+#if PUN_PLATFORM_WINDOWS
+    ReleaseSemaphore(semaphore->handle, count, 0);
+#else
+    pthread_mutex_lock(&semaphore->mutex);
+    semaphore->count += count;
+    pthread_cond_broadcast(&semaphore->cond);
+    pthread_mutex_unlock(&semaphore->mutex);
+#endif
+}
+
+static void
+semaphore_wait_(Semaphore_ *semaphore)
+{
+#if PUN_PLATFORM_WINDOWS
+    WaitForSingleObject(semaphore->handle, INFINITE);
+#else
+    pthread_mutex_lock(&semaphore->mutex);
+    while (semaphore->count == 0) {
+        pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+    }
+    semaphore->count--;
+    pthread_mutex_unlock(&semaphore->mutex);
+#endif
+}
+
+// Threads of `parallel_for`, started on the first call and then waiting for jobs.
+typedef struct
+{
+    Thread threads[PUN_THREADS_MAX];
+    ParallelForWorker_ workers[PUN_THREADS_MAX];
+    i32 threads_count;
+    b32 started;
+    // Posted once for each thread that should work on `job`.
+    Semaphore_ wake;
+    // Posted when the last of those threads is done.
+    Semaphore_ done;
+    ParallelFor_ *job;
+    volatile i32 pending;
+    // Non-zero while a `parallel_for` uses the pool.
+    volatile i32 busy;
+}
+ParallelForPool_;
+
+static ParallelForPool_ parallel_for_pool_;
+
+static THREAD_PROC(parallel_for_pool_worker_)
+{
+    ParallelForPool_ *pool = &parallel_for_pool_;
+    ParallelForWorker_ *worker = (ParallelForWorker_*)user;
+    for (;;) {
+        semaphore_wait_(&pool->wake);
+        worker->job = pool->job;
+        parallel_for_worker_(worker);
+        if (atomic_add(&pool->pending, -1) == 0) {
+            semaphore_post_(&pool->done, 1);
+        }
+    }
+}
+
+void
+parallel_for(i32 count, i32 grain, ParallelForProcF *proc, void *user)
+{
+    if (count <= 0) {
+        return;
+    }
+    grain = maximum(1, grain);
+
+    ParallelFor_ job;
+    job.proc = proc;
+    job.user = user;
+    job.count = count;
+    job.grain = grain;
+    job.next = 0;
+
+    // Worker 0 runs on the calling thread.
+    ParallelForWorker_ caller;
+    caller.job = &job;
+    caller.worker = 0;
+
+    // Nested or concurrent calls run on the calling thread only.
+    ParallelForPool_ *pool = &parallel_for_pool_;
+    if (atomic_add(&pool->busy, 1) != 1) {
+        atomic_add(&pool->busy, -1);
+        parallel_for_worker_(&caller);
+        return;
+    }
+
+    if (!pool->started) {
+        pool->started = true;
+        semaphore_init_(&pool->wake);
+        semaphore_init_(&pool->done);
+        for (i32 i = 1; i < cpu_count(); ++i) {
+            ParallelForWorker_ *worker = &pool->workers[pool->threads_count];
+            worker->worker = i;
+            if (!thread_start(&pool->threads[pool->threads_count], parallel_for_pool_worker_, worker)) {
+                break;
+            }
+            ++pool->threads_count;
+        }
+    }
+
+    i32 helpers = minimum(pool->threads_count, ceil_div(count, grain) - 1);
+    if (helpers > 0) {
+        pool->job = &job;
+        pool->pending = helpers;
+        semaphore_post_(&pool->wake, helpers);
+    }
+    parallel_for_worker_(&caller);
+    if (helpers > 0) {
+        semaphore_wait_(&pool->done);
+    }
+
+    atomic_add(&pool->busy, -1);
+}
+
+//
+// Memory
+//
+
+void *
+virtual_reserve(void *ptr, u32 size)
+{
+#if PUN_PLATFORM_WINDOWS
+    ptr = VirtualAlloc(ptr, size, MEM_RESERVE, PAGE_NOACCESS);
+    ASSERT(ptr);
+#else
     ptr = mmap((void*)ptr, size,
                PROT_NONE,
                MAP_PRIVATE | MAP_ANON,
@@ -1549,6 +2769,12 @@ virtual_alloc(void *ptr, u32 size)
 //
 //
 
+#if PUNITY_BITMAP_DEDUPE
+static void bitmap_registry_rewind_(Bank *bank);
+#else
+#define bitmap_registry_rewind_(bank)
+#endif
+
 void
 bank_init(Bank *bank, u32 capacity)
 {
@@ -1571,6 +2797,7 @@ void
 bank_clear(Bank *bank)
 {
     bank->it = bank->begin;
+    bitmap_registry_rewind_(bank);
 }
 
 void
@@ -1611,6 +2838,7 @@ bank_pop(Bank *stack, void *ptr)
     ASSERT(stack->begin);
     ASSERT((u8 *)ptr >= stack->begin && (u8 *)ptr <= stack->it);
     stack->it = ptr;
+    bitmap_registry_rewind_(stack);
 }
 
 BankState
@@ -1626,6 +2854,7 @@ void
 bank_end(BankState *state)
 {
     *state->bank = state->state;
+    bitmap_registry_rewind_(state->bank);
 }
 
 //
@@ -1888,10 +3117,66 @@ palette_range_add(Palette *palette, int begin, int end, int it)
     return palette->ranges_count++;
 }
 
+static inline u32
+palette_lookup_hash_(u32 rgba)
+{
+    return (rgba * 2654435761u) >> (32 - PUN_PALETTE_LOOKUP_BITS);
+}
+
+static void
+palette_lookup_insert_(Palette *palette, int index)
+{
+    u32 rgba = palette->colors[index].rgba;
+    if (rgba == 0) {
+        return;
+    }
+    // Keep the load factor under 3/4, stale entries are dropped on rebuild.
+    if (palette->lookup_count == (PUN_PALETTE_LOOKUP_SIZE * 3) / 4) {
+        palette->lookup_valid = false;
+        return;
+    }
+    u32 slot = palette_lookup_hash_(rgba);
+    while (palette->lookup[slot]) {
+        slot = (slot + 1) & (PUN_PALETTE_LOOKUP_SIZE - 1);
+    }
+    palette->lookup[slot] = (u16)(index + 1);
+    palette->lookup_count++;
+}
+
+static void
+palette_lookup_update_(Palette *palette)
+{
+    if (!palette->lookup_valid) {
+        memset(palette->lookup, 0, sizeof(palette->lookup));
+        palette->lookup_count = 0;
+        palette->lookup_valid = true;
+        for (int i = 0; i != array_count(palette->colors); ++i) {
+            palette_lookup_insert_(palette, i);
+        }
+    }
+}
+
+void
+palette_changed(Palette *palette)
+{
+    palette->lookup_valid = false;
+    for (int i = 0; i != palette->ranges_count; ++i) {
+        palette->ranges[i].version++;
+    }
+}
+
 u8
 palette_color_set(Palette *palette, u8 index, Color color)
 {
     palette->colors[index] = color;
+    for (int i = 0; i != palette->ranges_count; ++i) {
+        if (index >= palette->ranges[i].begin && index < palette->ranges[i].end) {
+            palette->ranges[i].version++;
+        }
+    }
+    if (palette->lookup_valid) {
+        palette_lookup_insert_(palette, index);
+    }
     return index;
 }
 
@@ -1906,7 +3191,7 @@ palette_color_add(Palette *palette, Color color, int range)
     LOG("Added color (%d, %d, %d, %d) to range %d at index %d.\n",
         color.r, color.g, color.b, color.a, range,
         r->it);
-    palette->colors[r->it] = color;
+    palette_color_set(palette, r->it, color);
     return r->it++;
 }
 
@@ -1915,13 +3200,33 @@ palette_color_find(Palette *palette, Color color, int range)
 {
     ASSERT(range < palette->ranges_count);
     PaletteRange *r = &palette->ranges[range];
-    Color *it = &palette->colors[r->begin];
-    for (int i = r->begin; i != r->it; ++i, ++it) {
-        if (it->rgba == color.rgba) {
-            return i;
+    if (color.rgba == 0) {
+        // Not in the lookup (most of unused colors are zero).
+        Color *it = &palette->colors[r->begin];
+        for (int i = r->begin; i != r->it; ++i, ++it) {
+            if (it->rgba == color.rgba) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    palette_lookup_update_(palette);
+
+    // The color can be in the palette more than once, we return the first one.
+    int found = -1;
+    int i;
+    u32 slot = palette_lookup_hash_(color.rgba);
+    while (palette->lookup[slot]) {
+        i = palette->lookup[slot] - 1;
+        if (palette->colors[i].rgba == color.rgba &&
+            i >= r->begin && i < r->it &&
+            (found == -1 || i < found)) {
+            found = i;
         }
+        slot = (slot + 1) & (PUN_PALETTE_LOOKUP_SIZE - 1);
     }
-    return -1;    
+    return found;
 }
 
 // Guarantees a find, this is last resort color matching function.
@@ -1949,6 +3254,87 @@ palette_color_find_fuzzy(Palette *palette, Color color, int range)
     return closest;
 }
 
+static void
+palette_cube_build_(Palette *palette, int range)
+{
+    PaletteRange *r = &palette->ranges[range];
+    u8 *cube = palette->cubes[range];
+    u8 *margins = cube + PUN_PALETTE_CUBE_SIZE;
+    i32 shift = 8 - PUN_PALETTE_CUBE_BITS;
+    i32 cells = 1 << PUN_PALETTE_CUBE_BITS;
+    i32 half = 1 << (shift - 1);
+    i32 r_, g_, b_, i, d, best, best_d, second_d;
+    Color *colors = palette->colors;
+    for (r_ = 0; r_ != cells; ++r_) {
+        for (g_ = 0; g_ != cells; ++g_) {
+            for (b_ = 0; b_ != cells; ++b_) {
+                // Center of the cell.
+                i32 cr = (r_ << shift) + half;
+                i32 cg = (g_ << shift) + half;
+                i32 cb = (b_ << shift) + half;
+                best = r->begin;
+                best_d = INT_MAX;
+                second_d = INT_MAX;
+                for (i = r->begin; i != r->it; ++i) {
+                    d = i32_abs(colors[i].r - cr) +
+                        i32_abs(colors[i].g - cg) +
+                        i32_abs(colors[i].b - cb);
+                    if (d < best_d) {
+                        best = i;
+                        second_d = best_d;
+                        best_d = d;
+                    } else if (d < second_d) {
+                        second_d = d;
+                    }
+                }
+                *cube++ = (u8)best;
+                *margins++ = (u8)minimum(second_d - best_d, 0xFF);
+            }
+        }
+    }
+    palette->cubes_version[range] = r->version;
+}
+
+// Returns the cube's color if it's the nearest one for every color closer to the
+// cell's center than half of the cell's margin (triangle inequality), otherwise
+// searches the range.
+static inline int
+palette_cube_find_(Palette *palette, u8 *cube, int range, i32 r, i32 g, i32 b)
+{
+    i32 shift = 8 - PUN_PALETTE_CUBE_BITS;
+    i32 half = 1 << (shift - 1);
+    i32 cell = ((r >> shift) << (PUN_PALETTE_CUBE_BITS * 2)) |
+               ((g >> shift) << PUN_PALETTE_CUBE_BITS) |
+                (b >> shift);
+    i32 mask = (1 << shift) - 1;
+    i32 d = i32_abs((r & mask) - half) +
+            i32_abs((g & mask) - half) +
+            i32_abs((b & mask) - half);
+    if (d * 2 < cube[PUN_PALETTE_CUBE_SIZE + cell]) {
+        return cube[cell];
+    }
+    return palette_color_find_fuzzy(palette, color_make((u8)r, (u8)g, (u8)b, 0xFF), range);
+}
+
+int
+palette_color_find_nearest(Palette *palette, Color color, int range)
+{
+    ASSERT(range < palette->ranges_count);
+    PaletteRange *r = &palette->ranges[range];
+    if (r->it == r->begin) {
+        return -1;
+    }
+
+    if (!palette->cubes[range]) {
+        palette->cubes[range] = virtual_alloc(0, PUN_PALETTE_CUBE_BYTES);
+        palette_cube_build_(palette, range);
+    } else if (palette->cubes_version[range] != r->version) {
+        palette_cube_build_(palette, range);
+    }
+
+    return palette_cube_find_(palette, palette->cubes[range], range, color.r, color.g, color.b);
+}
+
 int
 palette_color_acquire(Palette *palette, Color color, int range)
 {
@@ -1959,6 +3345,144 @@ palette_color_acquire(Palette *palette, Color color, int range)
     return index;
 }
 
+void
+palette_lerp(Color *dst, Color *src, size_t count, Color color, f32 t)
+{
+    size_t i = 0;
+    t = clamp(t, 0.0f, 1.0f);
+#if PUNITY_SIMD
+    // 7 bits of `t`, so (to - from) * t fits into i16.
+    __m128i mm_t = _mm_set1_epi16((i16)(t * 128.0f + 0.5f));
+    __m128i mm_to = _mm_unpacklo_epi8(_mm_set1_epi32((int)color.rgba), simd__.mm_00);
+    __m128i mm_alpha = _mm_set1_epi32((int)color_make(0, 0, 0, 0xFF).rgba);
+    __m128i mm, lo, hi;
+    for (; i + 4 <= count; i += 4) {
+        mm = _mm_loadu_si128((__m128i*)(src + i));
+        lo = _mm_unpacklo_epi8(mm, simd__.mm_00);
+        hi = _mm_unpackhi_epi8(mm, simd__.mm_00);
+        lo = _mm_add_epi16(lo, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(mm_to, lo), mm_t), 7));
+        hi = _mm_add_epi16(hi, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(mm_to, hi), mm_t), 7));
+        _mm_storeu_si128((__m128i*)(dst + i),
+            _mm_or_si128(
+                _mm_andnot_si128(mm_alpha, _mm_packus_epi16(lo, hi)),
+                _mm_and_si128(mm_alpha, mm)));
+    }
+#endif
+    for (; i != count; ++i) {
+        dst[i] = color_lerp(src[i], color, t);
+    }
+}
+
+//
+// Palette effects
+//
+
+void
+palettefx_clear(PaletteFx *fx)
+{
+    memset(fx, 0, sizeof(PaletteFx));
+}
+
+int
+palettefx_cycle_add(PaletteFx *fx, PaletteRange *range, f32 period)
+{
+    ASSERT_MESSAGE(fx->cycles_count != PUN_PALETTEFX_CYCLES_MAX,
+        "Too many cycles, increase PUN_PALETTEFX_CYCLES_MAX.");
+    ASSERT(period != 0);
+    PaletteCycle *cycle = fx->cycles + fx->cycles_count;
+    cycle->begin = range->begin;
+    cycle->end = range->it;
+    cycle->period = period;
+    return fx->cycles_count++;
+}
+
+void
+palettefx_cycle_remove(PaletteFx *fx, int index)
+{
+    ASSERT(index >= 0 && index < fx->cycles_count);
+    fx->cycles[index] = fx->cycles[--fx->cycles_count];
+}
+
+void
+palettefx_tint(PaletteFx *fx, Color color, f32 amount)
+{
+    fx->tint_color = color;
+    fx->tint_amount = amount;
+}
+
+void
+palettefx_fade(PaletteFx *fx, Color color, f32 from, f32 to, f32 duration)
+{
+    fx->fade_color = color;
+    fx->fade_from = from;
+    fx->fade_to = to;
+    fx->fade_time = 0;
+    fx->fade_duration = duration;
+}
+
+bool
+palettefx_fading(PaletteFx *fx)
+{
+    return fx->fade_time < fx->fade_duration;
+}
+
+void
+palettefx_flash(PaletteFx *fx, Color color, f32 duration)
+{
+    fx->flash_color = color;
+    fx->flash_time = 0;
+    fx->flash_duration = duration;
+}
+
+void
+palettefx_update(PaletteFx *fx, Palette *palette, f32 dt)
+{
+    fx->time += dt;
+    memcpy(fx->colors, palette->colors, sizeof(fx->colors));
+
+    PaletteCycle *cycle = fx->cycles;
+    i32 length, offset;
+    for (i32 i = 0; i != fx->cycles_count; ++i, ++cycle) {
+        length = cycle->end - cycle->begin;
+        if (length < 2) {
+            continue;
+        }
+        offset = (i32)(fx->time / cycle->period) % length;
+        if (offset < 0) {
+            offset += length;
+        }
+        // Rotate as two copies.
+        memcpy(fx->colors + cycle->begin,
+               palette->colors + cycle->begin + offset,
+               (length - offset) * sizeof(Color));
+        memcpy(fx->colors + cycle->begin + (length - offset),
+               palette->colors + cycle->begin,
+               offset * sizeof(Color));
+    }
+
+    if (fx->tint_amount > 0) {
+        palette_lerp(fx->colors, fx->colors, array_count(fx->colors), fx->tint_color, fx->tint_amount);
+    }
+
+    if (fx->fade_duration > 0) {
+        fx->fade_time = minimum(fx->fade_time + dt, fx->fade_duration);
+        f32 t = lerp(fx->fade_from, fx->fade_to, fx->fade_time / fx->fade_duration);
+        if (t > 0) {
+            palette_lerp(fx->colors, fx->colors, array_count(fx->colors), fx->fade_color, t);
+        }
+    }
+
+    if (fx->flash_time < fx->flash_duration) {
+        fx->flash_time += dt;
+        // Up and back down.
+        f32 t = minimum(fx->flash_time / fx->flash_duration, 1.0f) * 2.0f;
+        t = t < 1.0f ? t : 2.0f - t;
+        if (t > 0) {
+            palette_lerp(fx->colors, fx->colors, array_count(fx->colors), fx->flash_color, t);
+        }
+    }
+}
+
 //
 // Rectangle
 //
@@ -2293,6 +3817,9 @@ bitmap_draw_push(Bitmap *bitmap, i32 x, i32 y, i32 pivot_x, i32 pivot_y, Rect *b
 DrawListItem *
 tile_draw_push(Bitmap *bitmap, i32 x, i32 y, i32 index, i32 z)
 {
+    if (bitmap->animations) {
+        index = tile_animated(bitmap, index);
+    }
     Rect rect = tile_get(bitmap, index);
     return bitmap_draw_push(bitmap, x, y, 0, 0, &rect, z);
 }
@@ -2357,7 +3884,8 @@ clip_rect_with_offsets(Rect *R, Rect *C, i32 *ox, i32 *oy)
         *ox = C->min_x - R->min_x;
         R->min_x = C->min_x;
         res = 2;
-    } else if (R->max_x > C->max_x) {
+    }
+    if (R->max_x > C->max_x) {
         R->max_x = C->max_x;
         res = 2;
     }
@@ -2366,7 +3894,8 @@ clip_rect_with_offsets(Rect *R, Rect *C, i32 *ox, i32 *oy)
         *oy = C->min_y - R->min_y;
         R->min_y = C->min_y;
         res = 2;
-    } else if (R->max_y > C->max_y) {
+    }
+    if (R->max_y > C->max_y) {
         R->max_y = C->max_y;
         res = 2;
     }
@@ -2399,6 +3928,28 @@ clip_check()
            (CORE->canvas.clip.min_y <= CORE->canvas.clip.max_y);
 }
 
+void
+canvas_push(Bitmap *bitmap)
+{
+    ASSERT_MESSAGE(CORE->canvas_stack_count != PUN_CANVAS_STACK_MAX,
+        "Canvas stack is full, increase PUN_CANVAS_STACK_MAX.");
+    CORE->canvas_stack[CORE->canvas_stack_count++] = CORE->canvas;
+
+    CORE->canvas.bitmap = bitmap;
+    CORE->canvas.translate_x = 0;
+    CORE->canvas.translate_y = 0;
+    CORE->canvas.flags = 0;
+    CORE->canvas.mask = 0;
+    clip_reset();
+}
+
+void
+canvas_pop()
+{
+    ASSERT_MESSAGE(CORE->canvas_stack_count != 0, "canvas_pop without canvas_push.");
+    CORE->canvas = CORE->canvas_stack[--CORE->canvas_stack_count];
+}
+
 //
 // Resources
 //
@@ -2406,8 +3957,29 @@ clip_check()
 void *
 resource_get(const char *name, size_t *size)
 {
-#if PUN_PLATFORM_WINDOWS
-    HRSRC handle = FindResource(0, name, "RESOURCE");
+#if PUNITY_RESOURCES_PACK
+    Pack *pack = &CORE->resources;
+    if (!pack->data) {
+#if PUNITY_RESOURCES_EMBEDDED
+        bool opened = pack_open_memory(pack, (void*)punity_resources, punity_resources_size);
+#else
+        bool opened = pack_open(pack, PUNITY_RESOURCES_PACK_PATH);
+#endif
+        ASSERT_MESSAGE(opened, "Unable to open resources pack.");
+        if (!opened) {
+            // panic_ only asserts, which is compiled out with NDEBUG.
+            if (size) {
+                *size = 0;
+            }
+            return 0;
+        }
+    }
+
+    void *ptr = pack_resource_get(pack, name, size);
+    ASSERT_MESSAGE(ptr, "Resource %s not found.", name);
+    return ptr;
+#elif PUN_PLATFORM_WINDOWS
+    HRSRC handle = FindResource(0, name, "RESOURCE");
     ASSERT(handle);
 
     HGLOBAL data = LoadResource(0, handle);
@@ -2566,6 +4138,424 @@ frame_draw(Rect r, u8 frame_color, int frame_edges, u8 fill_color)
     }
 }
 
+//
+// Packed bitmaps
+//
+
+void
+bitmap_pack(Bank *bank, Bitmap *bitmap, Bitmap *source, int format, u8 base)
+{
+    ASSERT(source->format == BitmapFormat_8);
+    ASSERT(format == BitmapFormat_4 || format == BitmapFormat_1);
+
+    *bitmap = *source;
+    bitmap->format = format;
+    bitmap->base = base;
+    i32 bits = format == BitmapFormat_4 ? 4 : 1;
+    i32 max = format == BitmapFormat_4 ? 15 : 1;
+    bitmap->pitch = ceil_div(source->width * bits, 8);
+    // Expansion reads up to 16 bytes at once.
+    u32 size = bitmap->pitch * bitmap->height + 16;
+    bitmap->pixels = bank_push(bank, size);
+    memset(bitmap->pixels, 0, size);
+
+    u8 *src = source->pixels;
+    for (i32 y = 0; y != source->height; ++y) {
+        u8 *row = bitmap->pixels + y * bitmap->pitch;
+        for (i32 x = 0; x != source->width; ++x, ++src) {
+            if (*src == 0) {
+                continue;
+            }
+            i32 value = *src - base;
+            ASSERT_MESSAGE(value >= 1 && value <= max, "Pixel %d doesn't fit to the packed format.", *src);
+            i32 bit = x * bits;
+            row[bit >> 3] |= value << (bit & 7);
+        }
+    }
+}
+
+// Expands `count` 4-bit pixels of the `row` starting at pixel `x` to `dst`.
+static void
+bitmap_unpack_row4_(u8 *dst, u8 *row, i32 x, i32 count, u8 base)
+{
+    i32 end = x + count;
+    u8 value;
+    if (x & 1) {
+        value = row[x >> 1] >> 4;
+        *dst++ = value ? value + base : 0;
+        ++x;
+    }
+#if PUNITY_SIMD
+    __m128i mm_low  = _mm_set1_epi8(0x0F);
+    __m128i mm_base = _mm_set1_epi8(base);
+    for (; x + 32 <= end; x += 32, dst += 32) {
+        __m128i mm_s  = _mm_loadu_si128((__m128i*)(row + (x >> 1)));
+        __m128i mm_lo = _mm_and_si128(mm_s, mm_low);
+        __m128i mm_hi = _mm_and_si128(_mm_srli_epi16(mm_s, 4), mm_low);
+        __m128i mm_a  = _mm_unpacklo_epi8(mm_lo, mm_hi);
+        __m128i mm_b  = _mm_unpackhi_epi8(mm_lo, mm_hi);
+        // Zero stays transparent.
+        mm_a = _mm_andnot_si128(_mm_cmpeq_epi8(mm_a, simd__.mm_00), _mm_add_epi8(mm_a, mm_base));
+        mm_b = _mm_andnot_si128(_mm_cmpeq_epi8(mm_b, simd__.mm_00), _mm_add_epi8(mm_b, mm_base));
+        _mm_storeu_si128((__m128i*)dst, mm_a);
+        _mm_storeu_si128((__m128i*)(dst + 16), mm_b);
+    }
+#endif
+    for (; x != end; ++x) {
+        value = (row[x >> 1] >> ((x & 1) * 4)) & 0x0F;
+        *dst++ = value ? value + base : 0;
+    }
+}
+
+// Expands `count` 1-bit pixels of the `row` starting at pixel `x` to `dst`.
+static void
+bitmap_unpack_row1_(u8 *dst, u8 *row, i32 x, i32 count, u8 base)
+{
+    i32 end = x + count;
+    u8 color = base + 1;
+    for (; (x & 7) && x != end; ++x) {
+        *dst++ = (row[x >> 3] >> (x & 7)) & 1 ? color : 0;
+    }
+#if PUNITY_SIMD
+    __m128i mm_spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+    __m128i mm_bits   = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i mm_color  = _mm_set1_epi8(color);
+    for (; x + 16 <= end; x += 16, dst += 16) {
+        __m128i mm_s = _mm_cvtsi32_si128(*(u16*)(row + (x >> 3)));
+        mm_s = _mm_and_si128(_mm_shuffle_epi8(mm_s, mm_spread), mm_bits);
+        mm_s = _mm_and_si128(_mm_cmpeq_epi8(mm_s, mm_bits), mm_color);
+        _mm_storeu_si128((__m128i*)dst, mm_s);
+    }
+#endif
+    for (; x != end; ++x) {
+        *dst++ = (row[x >> 3] >> (x & 7)) & 1 ? color : 0;
+    }
+}
+
+void
+bitmap_unpack(Bitmap *bitmap, Rect rect, u8 *pixels)
+{
+    i32 width = rect.max_x - rect.min_x;
+    u8 *row = bitmap->pixels + rect.min_y * bitmap->pitch;
+    for (i32 y = rect.min_y; y != rect.max_y; ++y, row += bitmap->pitch, pixels += width) {
+        if (bitmap->format == BitmapFormat_4) {
+            bitmap_unpack_row4_(pixels, row, rect.min_x, width, bitmap->base);
+        } else {
+            bitmap_unpack_row1_(pixels, row, rect.min_x, width, bitmap->base);
+        }
+    }
+}
+
+static inline u8
+bitmap_packed_get_(u8 *row, i32 x, i32 bits)
+{
+    return bits == 4
+        ? (row[x >> 1] >> ((x & 1) * 4)) & 0x0F
+        : (row[x >> 3] >> (x & 7)) & 1;
+}
+
+#if PUNITY_SIMD
+// Draws 16 expanded pixels `mm_value` to `d`, zeros are transparent.
+static inline void
+bitmap_draw_packed_blend_(u8 *d, __m128i mm_value, __m128i mm_base, __m128i mm_mask, i32 mask)
+{
+    __m128i mm_empty = _mm_cmpeq_epi8(mm_value, simd__.mm_00);
+    __m128i mm_color = mask != -1 ? mm_mask : _mm_add_epi8(mm_value, mm_base);
+    _mm_storeu_si128((__m128i*)d,
+        _mm_or_si128(
+            _mm_and_si128(_mm_loadu_si128((__m128i*)d), mm_empty),
+            _mm_andnot_si128(mm_empty, mm_color)));
+}
+#endif
+
+// Draws `count` pixels of a packed `row` (`bits` per pixel) starting at pixel `u`
+// (going left if `flip` is set) to `d`. Pixels are expanded in registers and
+// non-zero ones are drawn as `base` + value, or `mask` if it's not -1.
+static void
+bitmap_draw_packed_row_(u8 *d, u8 *row, i32 u, i32 count, b32 flip, i32 bits, u8 base, i32 mask)
+{
+    i32 step = flip ? -1 : 1;
+    i32 per_byte = 8 / bits;
+    i32 i = 0;
+    u8 value;
+
+    // Align `u` (or `u + 1` when going left) to a byte.
+    for (; i != count && ((flip ? u + 1 : u) & (per_byte - 1)); ++i, u += step) {
+        value = bitmap_packed_get_(row, u, bits);
+        if (value) {
+            d[i] = mask != -1 ? (u8)mask : value + base;
+        }
+    }
+#if PUNITY_SIMD
+    __m128i mm_base = _mm_set1_epi8(base);
+    __m128i mm_mask = _mm_set1_epi8((u8)mask);
+    __m128i mm, mm_a, mm_b;
+    u16 bytes;
+    i32 first;
+    if (bits == 4)
+    {
+        __m128i mm_low = _mm_set1_epi8(0x0F);
+        for (; i + 32 <= count; i += 32, u += step * 32) {
+            first = flip ? u - 31 : u;
+            mm = _mm_loadu_si128((__m128i*)(row + (first >> 1)));
+            mm_a = _mm_and_si128(mm, mm_low);
+            mm_b = _mm_and_si128(_mm_srli_epi16(mm, 4), mm_low);
+            mm = mm_a;
+            mm_a = _mm_unpacklo_epi8(mm, mm_b);
+            mm_b = _mm_unpackhi_epi8(mm, mm_b);
+            if (flip) {
+                mm = _mm_shuffle_epi8(mm_a, simd__.mm_flip);
+                mm_a = _mm_shuffle_epi8(mm_b, simd__.mm_flip);
+                mm_b = mm;
+            }
+            bitmap_draw_packed_blend_(d + i, mm_a, mm_base, mm_mask, mask);
+            bitmap_draw_packed_blend_(d + i + 16, mm_b, mm_base, mm_mask, mask);
+        }
+    }
+    else
+    {
+        __m128i mm_spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+        __m128i mm_bits   = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        __m128i mm_one    = _mm_set1_epi8(1);
+        for (; i + 16 <= count; i += 16, u += step * 16) {
+            first = flip ? u - 15 : u;
+            memcpy(&bytes, row + (first >> 3), 2);
+            mm = _mm_cvtsi32_si128(bytes);
+            mm = _mm_and_si128(_mm_shuffle_epi8(mm, mm_spread), mm_bits);
+            mm = _mm_and_si128(_mm_cmpeq_epi8(mm, mm_bits), mm_one);
+            if (flip) {
+                mm = _mm_shuffle_epi8(mm, simd__.mm_flip);
+            }
+            bitmap_draw_packed_blend_(d + i, mm, mm_base, mm_mask, mask);
+        }
+    }
+#endif
+    for (; i != count; ++i, u += step) {
+        value = bitmap_packed_get_(row, u, bits);
+        if (value) {
+            d[i] = mask != -1 ? (u8)mask : value + base;
+        }
+    }
+}
+
+// Fills `line` with `count` pixels of the drawn (flipped) bitmap's `row`
+// starting at column `from`. Pixels outside of the bitmap are zero.
+static void
+bitmap_draw_effects_line_(u8 *line, Bitmap *bitmap, Rect *s_r, u32 flags, i32 row, i32 from, i32 count)
+{
+    memset(line, 0, count);
+    i32 min = maximum(0, from);
+    i32 max = minimum(rect_width(s_r), from + count);
+    if (row < 0 || row >= rect_height(s_r) || min >= max) {
+        return;
+    }
+
+    i32 v = (flags & DrawFlags_FlipV) ? s_r->max_y - 1 - row : s_r->min_y + row;
+    u8 *dst = line + (min - from);
+    if (bitmap->format != BitmapFormat_8) {
+        bitmap_draw_packed_row_(dst, bitmap->pixels + v * bitmap->pitch,
+            (flags & DrawFlags_FlipH) ? s_r->max_x - 1 - min : s_r->min_x + min,
+            max - min, flags & DrawFlags_FlipH,
+            bitmap->format == BitmapFormat_4 ? 4 : 1, bitmap->base, -1);
+        return;
+    }
+
+    u8 *src = bitmap->pixels + v * bitmap->width;
+    if (flags & DrawFlags_FlipH) {
+        src += s_r->max_x - 1 - min;
+        for (i32 i = min; i != max; ++i) {
+            *dst++ = *src--;
+        }
+    } else {
+        memcpy(dst, src + s_r->min_x + min, max - min);
+    }
+}
+
+// Handles DrawFlags_Outline and DrawFlags_Shadow in a single pass over the clipped
+// destination. Source rows around the drawn row are kept in zero-padded lines,
+// the outline (opacity dilated by one pixel, 4-neighborhood) and the shadow are
+// computed from them while blitting.
+static void
+bitmap_draw_effects_(Bitmap *bitmap, i32 x, i32 y, i32 pivot_x, i32 pivot_y, Rect *bitmap_rect)
+{
+    Canvas *canvas = &CORE->canvas;
+    u32 flags = canvas->flags;
+    Bitmap *d_bmp = canvas->bitmap;
+
+    Rect s_r = rect_make_size(0, 0, bitmap->width, bitmap->height);
+    if (bitmap_rect) {
+        rect_intersect(&s_r, bitmap_rect);
+    }
+    i32 sw = rect_width(&s_r);
+    i32 sh = rect_height(&s_r);
+    if (sw <= 0 || sh <= 0) {
+        return;
+    }
+
+    i32 outline = (flags & DrawFlags_Outline) ? 1 : 0;
+    i32 shadow_x = 0;
+    i32 shadow_y = 0;
+    if (flags & DrawFlags_Shadow) {
+        shadow_x = canvas->shadow_x;
+        shadow_y = canvas->shadow_y;
+    }
+
+    // Position of the bitmap and the rect covered by the effects, clipped.
+    i32 ox = x - pivot_x + canvas->translate_x;
+    i32 oy = y - pivot_y + canvas->translate_y;
+    Rect d_r = rect_make(
+        ox - maximum(outline, -shadow_x),
+        oy - maximum(outline, -shadow_y),
+        ox + sw + maximum(outline, shadow_x),
+        oy + sh + maximum(outline, shadow_y));
+    d_r = rect_clip(d_r, canvas->clip);
+    i32 w = rect_width(&d_r);
+    if (w <= 0 || rect_height(&d_r) <= 0) {
+        return;
+    }
+
+    u8 silhouette = (flags & DrawFlags_Mask) ? canvas->mask : 0;
+    u8 outline_color = outline ? canvas->outline : 0;
+    u8 shadow_color = (flags & DrawFlags_Shadow) ? canvas->shadow : 0;
+
+    BankState bank_state = bank_begin(CORE->stack);
+
+    // Lines start `border` pixels left of the clipped rect, so the neighbors
+    // and the shadow can be read without checks. The SIMD loop reads up to 16 bytes past the end.
+    i32 border = 1 + abs(shadow_x);
+    i32 from = d_r.min_x - ox - border;
+    i32 count = w + border * 2;
+    u8 *lines[4];
+    for (i32 i = 0; i != 4; ++i) {
+        lines[i] = bank_push_t(CORE->stack, u8, count + 16);
+        memset(lines[i] + count, 0, 16);
+    }
+    u8 *up = lines[0], *self = lines[1], *down = lines[2], *shadow = lines[3];
+
+    i32 row = d_r.min_y - oy;
+    bitmap_draw_effects_line_(up,   bitmap, &s_r, flags, row - 1, from, count);
+    bitmap_draw_effects_line_(self, bitmap, &s_r, flags, row,     from, count);
+    bitmap_draw_effects_line_(down, bitmap, &s_r, flags, row + 1, from, count);
+
+    u8 *d = d_bmp->pixels + d_r.min_x + (d_r.min_y * d_bmp->width);
+    for (i32 dy = d_r.min_y; dy != d_r.max_y; ++dy, ++row, d += d_bmp->width)
+    {
+        if (dy != d_r.min_y) {
+            u8 *t = up;
+            up = self;
+            self = down;
+            down = t;
+            bitmap_draw_effects_line_(down, bitmap, &s_r, flags, row + 1, from, count);
+        }
+        if (shadow_color) {
+            bitmap_draw_effects_line_(shadow, bitmap, &s_r, flags, row - shadow_y, from, count);
+        }
+
+        u8 *s = self + border;
+        u8 *u = up + border;
+        u8 *n = down + border;
+        u8 *h = shadow + border - shadow_x;
+        i32 ix = 0;
+#if PUNITY_SIMD
+        __m128i mm_self, mm_transparent, mm_around, mm_rest, mm_dst;
+        __m128i mm_silhouette = _mm_set1_epi8(silhouette);
+        __m128i mm_outline_color = _mm_set1_epi8(outline_color);
+        __m128i mm_shadow_color = _mm_set1_epi8(shadow_color);
+        for (; ix + 16 <= w; ix += 16)
+        {
+            mm_self = _mm_loadu_si128((__m128i*)(s + ix));
+            mm_transparent = _mm_cmpeq_epi8(mm_self, simd__.mm_00);
+            if (silhouette) {
+                mm_self = _mm_andnot_si128(mm_transparent, mm_silhouette);
+            }
+
+            mm_rest = simd__.mm_00;
+            if (shadow_color) {
+                mm_rest = _mm_andnot_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(h + ix)), simd__.mm_00),
+                    mm_shadow_color);
+            }
+            if (outline_color) {
+                mm_around = _mm_cmpeq_epi8(
+                    _mm_or_si128(
+                        _mm_or_si128(_mm_loadu_si128((__m128i*)(s + ix - 1)),
+                                     _mm_loadu_si128((__m128i*)(s + ix + 1))),
+                        _mm_or_si128(_mm_loadu_si128((__m128i*)(u + ix)),
+                                     _mm_loadu_si128((__m128i*)(n + ix)))),
+                    simd__.mm_00);
+                mm_rest = _mm_or_si128(
+                    _mm_and_si128(mm_around, mm_rest),
+                    _mm_andnot_si128(mm_around, mm_outline_color));
+            }
+
+            // Opaque pixels, then the outline or shadow, then the destination.
+            mm_dst = _mm_loadu_si128((__m128i*)(d + ix));
+            mm_rest = _mm_or_si128(mm_rest, _mm_and_si128(mm_dst, _mm_cmpeq_epi8(mm_rest, simd__.mm_00)));
+            _mm_storeu_si128((__m128i*)(d + ix),
+                _mm_or_si128(_mm_andnot_si128(mm_transparent, mm_self),
+                             _mm_and_si128(mm_transparent, mm_rest)));
+        }
+#endif
+        for (; ix != w; ++ix)
+        {
+            if (s[ix]) {
+                d[ix] = silhouette ? silhouette : s[ix];
+            } else if (outline_color && (s[ix - 1] | s[ix + 1] | u[ix] | n[ix])) {
+                d[ix] = outline_color;
+            } else if (shadow_color && h[ix]) {
+                d[ix] = shadow_color;
+            }
+        }
+    }
+
+    bank_end(&bank_state);
+}
+
+// Draws a packed bitmap directly from its packed rows, only the part inside the clip is expanded.
+// Non-zero pixels are drawn with `mask` if it's not -1.
+static void
+bitmap_draw_packed_(Bitmap *bitmap, i32 x, i32 y, i32 pivot_x, i32 pivot_y, Rect *bitmap_rect, i32 mask)
+{
+    u32 flags = CORE->canvas.flags;
+    if (flags & (DrawFlags_Outline | DrawFlags_Shadow)) {
+        bitmap_draw_effects_(bitmap, x, y, pivot_x, pivot_y, bitmap_rect);
+        return;
+    }
+
+    Rect src_r = rect_make_size(0, 0, bitmap->width, bitmap->height);
+    if (bitmap_rect) {
+        ASSERT(rect_check_limits(bitmap_rect, 0, 0, bitmap->width, bitmap->height));
+        src_r = *bitmap_rect;
+    }
+
+    Bitmap *dst_bitmap = CORE->canvas.bitmap;
+    Rect dst_r = rect_make_size(x - pivot_x, y - pivot_y, rect_width(&src_r), rect_height(&src_r));
+    rect_tr(&dst_r, CORE->canvas.translate_x, CORE->canvas.translate_y);
+    i32 src_ox = 0;
+    i32 src_oy = 0;
+    if (!clip_rect_with_offsets(&dst_r, &CORE->canvas.clip, &src_ox, &src_oy)) {
+        return;
+    }
+
+    i32 dst_w = rect_width(&dst_r);
+    i32 dst_h = rect_height(&dst_r);
+    b32 flip = flags & DrawFlags_FlipH;
+    i32 u = flip ? src_r.max_x - 1 - src_ox : src_r.min_x + src_ox;
+    i32 v = src_r.min_y + src_oy;
+    i32 step_v = bitmap->pitch;
+    if (flags & DrawFlags_FlipV) {
+        v = src_r.max_y - 1 - src_oy;
+        step_v = -step_v;
+    }
+
+    i32 bits = bitmap->format == BitmapFormat_4 ? 4 : 1;
+    u8 *row = bitmap->pixels + v * bitmap->pitch;
+    u8 *dst = dst_bitmap->pixels + dst_r.min_x + (dst_r.min_y * dst_bitmap->width);
+    for (i32 y_ = 0; y_ != dst_h; ++y_, row += step_v, dst += dst_bitmap->width) {
+        bitmap_draw_packed_row_(dst, row, u, dst_w, flip, bits, bitmap->base, mask);
+    }
+}
+
 #if PUNITY_SIMD
 // https://software.intel.com/sites/landingpage/IntrinsicsGuide/#techs=SSE,SSE2,SSE3
 // TODO: Use _mm_loadu_si128((__m128i*)(dit));?
@@ -2692,6 +4682,15 @@ bitmap_draw_simd_nflip_(Bitmap *d_bmp, Bitmap *s_bmp, u8 *d, u8 *s, int spitch,
 void
 bitmap_draw_simd_(Bitmap *s_bmp, int x, int y, int px, int py, Rect *clip)
 {
+    if (s_bmp->format != BitmapFormat_8) {
+        bitmap_draw_packed_(s_bmp, x, y, px, py, clip, CORE->canvas.mask ? CORE->canvas.mask : -1);
+        return;
+    }
+    if (CORE->canvas.flags & (DrawFlags_Outline | DrawFlags_Shadow)) {
+        bitmap_draw_effects_(s_bmp, x, y, px, py, clip);
+        return;
+    }
+
     int mask = CORE->canvas.mask;
     int flag = CORE->canvas.flags;
     Bitmap *d_bmp = CORE->canvas.bitmap;
@@ -2705,7 +4704,7 @@ bitmap_draw_simd_(Bitmap *s_bmp, int x, int y, int px, int py, Rect *clip)
     // Destination rectangle.
     Rect d_r = rect_make_size(x - px, y - py,
                               s_r.max_x - s_r.min_x,
-                              minimum(d_bmp->height, s_r.max_y - s_r.min_y));
+                              s_r.max_y - s_r.min_y);
 
     // Translate.
     rect_tr(&d_r, CORE->canvas.translate_x, CORE->canvas.translate_y);
@@ -2771,6 +4770,15 @@ bitmap_draw_single_(Bitmap *src_bitmap, i32 x, i32 y, i32 pivot_x, i32 pivot_y,
     ASSERT(src_bitmap);
     ASSERT(clip_check());
 
+    if (src_bitmap->format != BitmapFormat_8) {
+        bitmap_draw_packed_(src_bitmap, x, y, pivot_x, pivot_y, bitmap_rect, (flags & DrawFlags_Mask) ? mask : -1);
+        return;
+    }
+    if (flags & (DrawFlags_Outline | DrawFlags_Shadow)) {
+        bitmap_draw_effects_(src_bitmap, x, y, pivot_x, pivot_y, bitmap_rect);
+        return;
+    }
+
     Rect src_r;
     if (bitmap_rect) {
         ASSERT(rect_check_limits(bitmap_rect, 0, 0, src_bitmap->width, src_bitmap->height));
@@ -2787,7 +4795,7 @@ bitmap_draw_single_(Bitmap *src_bitmap, i32 x, i32 y, i32 pivot_x, i32 pivot_y,
     Bitmap *dst_bitmap = CORE->canvas.bitmap;
     Rect dst_r = rect_make_size(x - pivot_x, y - pivot_y,
                                 src_r.max_x - src_r.min_x,
-                                minimum(dst_bitmap->height, src_r.max_y - src_r.min_y));
+                                src_r.max_y - src_r.min_y);
     rect_tr(&dst_r, CORE->canvas.translate_x, CORE->canvas.translate_y);
     i32 src_ox = 0;
     i32 src_oy = 0;
@@ -2876,9 +4884,76 @@ tile_get(Bitmap *bitmap, i32 index)
     return rect;
 }
 
+//
+// Tile animations
+//
+
+// Incremented by each `tile_animation_add`, so tilemap caches know to redraw their chunks.
+static u32 tile_animations_version_;
+
+void
+tile_animation_add(Bitmap *tileset, i32 index, TileFrame *frames, i32 frames_count)
+{
+    ASSERT(frames_count > 0);
+    TileAnimations *animations = tileset->animations;
+    if (!animations) {
+        animations = bank_push_t(CORE->storage, TileAnimations, 1);
+        memset(animations, 0, sizeof(TileAnimations));
+        animations->tiles_count = (tileset->width / tileset->tile_width) * (tileset->height / tileset->tile_height);
+        animations->lookup = bank_push_t(CORE->storage, i16, animations->tiles_count);
+        memset(animations->lookup, 0xFF, animations->tiles_count * sizeof(i16));
+        // Forces update of `current` on the first draw.
+        animations->time = -1;
+        tileset->animations = animations;
+    }
+    ASSERT(index >= 0 && index < animations->tiles_count);
+    ASSERT_MESSAGE(animations->count != PUN_TILE_ANIMATIONS_MAX, "Too many tile animations, increase PUN_TILE_ANIMATIONS_MAX.");
+
+    TileAnimation *animation = animations->items + animations->count;
+    animation->frames = bank_push_t(CORE->storage, TileFrame, frames_count);
+    memcpy(animation->frames, frames, frames_count * sizeof(TileFrame));
+    animation->frames_count = frames_count;
+    animation->duration = 0;
+    for (i32 i = 0; i != frames_count; ++i) {
+        animation->duration += frames[i].duration;
+    }
+    animations->current[animations->count] = frames[0].index;
+    animations->lookup[index] = (i16)animations->count++;
+    animations->time = -1;
+    ++tile_animations_version_;
+}
+
+i32
+tile_animated(Bitmap *tileset, i32 index)
+{
+    TileAnimations *animations = tileset->animations;
+    if (!animations || index < 0 || index >= animations->tiles_count || animations->lookup[index] == -1) {
+        return index;
+    }
+    if (animations->time != CORE->time)
+    {
+        // All animations of the tileset advance once per frame, no matter how many tiles are drawn.
+        animations->time = CORE->time;
+        TileAnimation *animation = animations->items;
+        for (i32 i = 0; i != animations->count; ++i, ++animation) {
+            f32 t = animation->duration > 0 ? fmodf(CORE->time, animation->duration) : 0;
+            i32 f = 0;
+            while (f != animation->frames_count - 1 && t >= animation->frames[f].duration) {
+                t -= animation->frames[f].duration;
+                ++f;
+            }
+            animations->current[i] = animation->frames[f].index;
+        }
+    }
+    return animations->current[animations->lookup[index]];
+}
+
 void
 tile_draw(Bitmap *bitmap, i32 index, i32 x, i32 y)
 {
+    if (bitmap->animations) {
+        index = tile_animated(bitmap, index);
+    }
     Rect rect = tile_get(bitmap, index);
     bitmap_draw(bitmap, x, y, 0, 0, &rect);
 }
@@ -2904,6 +4979,201 @@ bitmap_copy(Bitmap *destination, Bitmap *source)
     }
 }
 
+//
+// Scaling
+//
+
+static void
+scale_row_nearest_(u8 *dst, u8 *src, i32 width, i32 scale)
+{
+    if (scale == 1) {
+        memcpy(dst, src, width);
+        return;
+    }
+
+    i32 x = 0;
+#if PUNITY_SIMD
+    __m128i mm, lo, hi;
+    switch (scale)
+    {
+    case 2:
+        for (; x + 16 <= width; x += 16, dst += 32) {
+            mm = _mm_loadu_si128((__m128i*)(src + x));
+            _mm_storeu_si128((__m128i*)(dst),      _mm_unpacklo_epi8(mm, mm));
+            _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi8(mm, mm));
+        }
+        break;
+    case 3:
+        for (; x + 16 <= width; x += 16, dst += 48) {
+            mm = _mm_loadu_si128((__m128i*)(src + x));
+            _mm_storeu_si128((__m128i*)(dst),      _mm_shuffle_epi8(mm, simd__.scale3[0]));
+            _mm_storeu_si128((__m128i*)(dst + 16), _mm_shuffle_epi8(mm, simd__.scale3[1]));
+            _mm_storeu_si128((__m128i*)(dst + 32), _mm_shuffle_epi8(mm, simd__.scale3[2]));
+        }
+        break;
+    case 4:
+        for (; x + 16 <= width; x += 16, dst += 64) {
+            mm = _mm_loadu_si128((__m128i*)(src + x));
+            lo = _mm_unpacklo_epi8(mm, mm);
+            hi = _mm_unpackhi_epi8(mm, mm);
+            _mm_storeu_si128((__m128i*)(dst),      _mm_unpacklo_epi16(lo, lo));
+            _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(lo, lo));
+            _mm_storeu_si128((__m128i*)(dst + 32), _mm_unpacklo_epi16(hi, hi));
+            _mm_storeu_si128((__m128i*)(dst + 48), _mm_unpackhi_epi16(hi, hi));
+        }
+        break;
+    }
+#endif
+    for (; x != width; ++x, dst += scale) {
+        memset(dst, src[x], scale);
+    }
+}
+
+// Copies `src` row to `dst` with one pixel repeated on both sides,
+// so the EPX filters can read left and right neighbors without checks.
+static inline void
+scale_row_pad_(u8 *dst, u8 *src, i32 width)
+{
+    dst[-1] = src[0];
+    memcpy(dst, src, width);
+    dst[width] = src[width - 1];
+}
+
+//    B
+//  D E F
+//    H
+static void
+scale_row_epx2_(u8 *d0, u8 *d1, u8 *b, u8 *e, u8 *h, i32 width)
+{
+    i32 x = 0;
+#if PUNITY_SIMD
+    __m128i mm_B, mm_D, mm_E, mm_F, mm_H, c, e0, e1, e2, e3;
+    for (; x + 16 <= width; x += 16, d0 += 32, d1 += 32)
+    {
+        mm_B = _mm_loadu_si128((__m128i*)(b + x));
+        mm_E = _mm_loadu_si128((__m128i*)(e + x));
+        mm_H = _mm_loadu_si128((__m128i*)(h + x));
+        mm_D = _mm_loadu_si128((__m128i*)(e + x - 1));
+        mm_F = _mm_loadu_si128((__m128i*)(e + x + 1));
+
+        // B != H && D != F
+        c = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(mm_B, mm_H), _mm_cmpeq_epi8(mm_D, mm_F)), simd__.mm_FF);
+
+#define PUNP_SELECT_(m, a, b) _mm_or_si128(_mm_and_si128((m), (a)), _mm_andnot_si128((m), (b)))
+        e0 = PUNP_SELECT_(_mm_and_si128(c, _mm_cmpeq_epi8(mm_D, mm_B)), mm_D, mm_E);
+        e1 = PUNP_SELECT_(_mm_and_si128(c, _mm_cmpeq_epi8(mm_B, mm_F)), mm_F, mm_E);
+        e2 = PUNP_SELECT_(_mm_and_si128(c, _mm_cmpeq_epi8(mm_D, mm_H)), mm_D, mm_E);
+        e3 = PUNP_SELECT_(_mm_and_si128(c, _mm_cmpeq_epi8(mm_H, mm_F)), mm_F, mm_E);
+#undef PUNP_SELECT_
+
+        _mm_storeu_si128((__m128i*)(d0),      _mm_unpacklo_epi8(e0, e1));
+        _mm_storeu_si128((__m128i*)(d0 + 16), _mm_unpackhi_epi8(e0, e1));
+        _mm_storeu_si128((__m128i*)(d1),      _mm_unpacklo_epi8(e2, e3));
+        _mm_storeu_si128((__m128i*)(d1 + 16), _mm_unpackhi_epi8(e2, e3));
+    }
+#endif
+    u8 B, D, E, F, H;
+    for (; x != width; ++x, d0 += 2, d1 += 2)
+    {
+        B = b[x]; D = e[x - 1]; E = e[x]; F = e[x + 1]; H = h[x];
+        if (B != H && D != F) {
+            d0[0] = D == B ? D : E;
+            d0[1] = B == F ? F : E;
+            d1[0] = D == H ? D : E;
+            d1[1] = H == F ? F : E;
+        } else {
+            d0[0] = d0[1] = d1[0] = d1[1] = E;
+        }
+    }
+}
+
+//  A B C
+//  D E F
+//  G H I
+static void
+scale_row_epx3_(u8 *d0, u8 *d1, u8 *d2, u8 *b, u8 *e, u8 *h, i32 width)
+{
+    u8 A, B, C, D, E, F, G, H, I;
+    for (i32 x = 0; x != width; ++x, d0 += 3, d1 += 3, d2 += 3)
+    {
+        A = b[x - 1]; B = b[x]; C = b[x + 1];
+        D = e[x - 1]; E = e[x]; F = e[x + 1];
+        G = h[x - 1]; H = h[x]; I = h[x + 1];
+        if (B != H && D != F) {
+            d0[0] = D == B ? D : E;
+            d0[1] = ((D == B && E != C) || (B == F && E != A)) ? B : E;
+            d0[2] = B == F ? F : E;
+            d1[0] = ((D == B && E != G) || (D == H && E != A)) ? D : E;
+            d1[1] = E;
+            d1[2] = ((B == F && E != I) || (H == F && E != C)) ? F : E;
+            d2[0] = D == H ? D : E;
+            d2[1] = ((D == H && E != I) || (H == F && E != G)) ? H : E;
+            d2[2] = H == F ? F : E;
+        } else {
+            d0[0] = d0[1] = d0[2] = E;
+            d1[0] = d1[1] = d1[2] = E;
+            d2[0] = d2[1] = d2[2] = E;
+        }
+    }
+}
+
+void
+bitmap_scale_rows(Bitmap *destination, Bitmap *source, i32 scale, int filter, i32 min_y, i32 max_y)
+{
+    ASSERT(scale >= 1);
+    ASSERT(destination->width  == source->width  * scale);
+    ASSERT(destination->height == source->height * scale);
+
+    min_y = maximum(0, min_y);
+    max_y = minimum(source->height, max_y);
+    if (min_y >= max_y) {
+        return;
+    }
+
+    i32 sw = source->width;
+    i32 dw = destination->width;
+    u8 *src = source->pixels + (min_y * sw);
+    u8 *dst = destination->pixels + (min_y * scale * dw);
+    i32 y, i;
+
+    if (filter == ScaleFilter_EPX && (scale == 2 || scale == 3))
+    {
+        BankState bank_state = bank_begin(CORE->stack);
+        u8 *pad = bank_push(CORE->stack, (sw + 2) * 3);
+        u8 *b = pad + 1;
+        u8 *e = b + (sw + 2);
+        u8 *h = e + (sw + 2);
+        for (y = min_y; y != max_y; ++y, src += sw, dst += dw * scale)
+        {
+            scale_row_pad_(b, y == 0 ? src : src - sw, sw);
+            scale_row_pad_(e, src, sw);
+            scale_row_pad_(h, y == source->height - 1 ? src : src + sw, sw);
+            if (scale == 2) {
+                scale_row_epx2_(dst, dst + dw, b, e, h, sw);
+            } else {
+                scale_row_epx3_(dst, dst + dw, dst + dw * 2, b, e, h, sw);
+            }
+        }
+        bank_end(&bank_state);
+    }
+    else
+    {
+        for (y = min_y; y != max_y; ++y, src += sw, dst += dw * scale)
+        {
+            scale_row_nearest_(dst, src, sw, scale);
+            for (i = 1; i < scale; ++i) {
+                memcpy(dst + (i * dw), dst, dw);
+            }
+        }
+    }
+}
+
+void
+bitmap_scale(Bitmap *destination, Bitmap *source, i32 scale, int filter)
+{
+    bitmap_scale_rows(destination, source, scale, filter, 0, source->height);
+}
+
 void
 text_measure(const char *text, i32 *w, i32 *h)
 {
@@ -3032,7 +5302,15 @@ bitmap_init_(Bitmap *bitmap, void *pixels, int type, const char *path)
 
         if (type != PUN_BITMAP_MASK)
         {
+            // Neighboring pixels are often the same.
+            u32 last_rgba = 0;
+            int last_ix = -1;
             for (; pixels_it != pixels_end; ++pixels_it) {
+                if (last_ix != -1 && pixels_it->rgba == last_rgba) {
+                    *it++ = last_ix;
+                    continue;
+                }
+                last_rgba = pixels_it->rgba;
                 if (pixels_it->a < 0x7F) {
                     ix = 0;
                 } else {
@@ -3047,7 +5325,7 @@ bitmap_init_(Bitmap *bitmap, void *pixels, int type, const char *path)
                         //     pixels_it->r, pixels_it->g, pixels_it->b, pixels_it->a,
                         //     path ? " in bitmap " : "",
                         //     path ? path : "");
-                        ix = palette_color_find_fuzzy(CORE->palette, pixel, bitmap->palette_range);
+                        ix = palette_color_find_nearest(CORE->palette, pixel, bitmap->palette_range);
                         if (ix >= 0) {
                             // printf("- found fuzzy (%d, %d, %d, %d)\n",
                             //     palette->colors[ix].r, palette->colors[ix].g, palette->colors[ix].b,
@@ -3057,6 +5335,7 @@ bitmap_init_(Bitmap *bitmap, void *pixels, int type, const char *path)
                         }
                     }
                 }
+                last_ix = ix;
                 *it++ = ix;
             }
         }
@@ -3076,15 +5355,266 @@ bitmap_init_(Bitmap *bitmap, void *pixels, int type, const char *path)
     return 1;
 }
 
-void
-bitmap_init_ex_(Bank *bank, Bitmap *bitmap, i32 width, i32 height, void *pixels, int bpp, int palette_range, const char *path)
-{
-    bitmap->width = width;
-    bitmap->pitch = align_to(width, 16);
-    bitmap->height = height;
-    bitmap->palette_range = palette_range;
+//
+// Dithered import
+//
 
-    u32 size = bitmap->pitch * height;
+// Rows converted by a single job.
+#define PUNP_IMPORT_BAND_ROWS (32)
+// Range of the ordered dithering offsets per channel.
+#define PUNP_DITHER_ORDERED_SPREAD (32)
+
+static const u8 punp_bayer8_[64] = {
+     0, 32,  8, 40,  2, 34, 10, 42,
+    48, 16, 56, 24, 50, 18, 58, 26,
+    12, 44,  4, 36, 14, 46,  6, 38,
+    60, 28, 52, 20, 62, 30, 54, 22,
+     3, 35, 11, 43,  1, 33,  9, 41,
+    51, 19, 59, 27, 49, 17, 57, 25,
+    15, 47,  7, 39, 13, 45,  5, 37,
+    63, 31, 55, 23, 61, 29, 53, 21,
+};
+
+typedef struct
+{
+    // Read-only snapshot of the palette shared by the workers.
+    Palette palette;
+    u8 *cube;
+    int range;
+    int dither;
+    Color *pixels;
+    Bitmap *bitmap;
+    // Two rows of errors (r, g, b) for each worker (Dither_Diffuse only).
+    i16 *errors;
+}
+BitmapImport_;
+
+static inline int
+bitmap_import_nearest_(BitmapImport_ *I, i32 r, i32 g, i32 b)
+{
+    return palette_cube_find_(&I->palette, I->cube, I->range,
+        clamp(r, 0, 255), clamp(g, 0, 255), clamp(b, 0, 255));
+}
+
+// Adds to the stored (r, g, b) error, saturated to the i16 range.
+static inline void
+bitmap_import_error_add_(i16 *e, i32 r, i32 g, i32 b)
+{
+    e[0] = (i16)clamp(e[0] + r, -0x8000, 0x7FFF);
+    e[1] = (i16)clamp(e[1] + g, -0x8000, 0x7FFF);
+    e[2] = (i16)clamp(e[2] + b, -0x8000, 0x7FFF);
+}
+
+static PARALLEL_FOR_PROC(bitmap_import_band_)
+{
+    BitmapImport_ *I = (BitmapImport_*)user;
+    i32 w = I->bitmap->width;
+    i32 y_begin = begin * PUNP_IMPORT_BAND_ROWS;
+    i32 y_end = minimum(end * PUNP_IMPORT_BAND_ROWS, I->bitmap->height);
+
+    // Errors are indexed from -1 to `w` (inclusive) so the neighbors need no checks.
+    i32 errors_pitch = (w + 2) * 3;
+    i16 *errors_cur = 0;
+    i16 *errors_next = 0;
+    if (I->dither == Dither_Diffuse) {
+        errors_cur  = I->errors + (worker * errors_pitch * 2);
+        errors_next = errors_cur + errors_pitch;
+        memset(errors_cur, 0, errors_pitch * 2 * sizeof(i16));
+    }
+
+    Color *colors = I->palette.colors;
+    Color *src;
+    Color c;
+    u8 *dst;
+    i32 x, y, r, g, b, t;
+    int ix;
+    i16 *e, *n, *swap;
+    for (y = y_begin; y != y_end; ++y)
+    {
+        src = I->pixels + (y * w);
+        dst = I->bitmap->pixels + (y * w);
+        for (x = 0; x != w; ++x, ++src, ++dst)
+        {
+            if (src->a < 0x7F) {
+                *dst = 0;
+                continue;
+            }
+
+            c.r = src->b;
+            c.g = src->g;
+            c.b = src->r;
+            c.a = 0xFF;
+            // With Dither_Diffuse the incoming error has to be applied and passed on,
+            // so exact colors are only kept where no error reaches them.
+            e = errors_cur ? errors_cur + ((x + 1) * 3) : 0;
+            if (!e || (e[0] | e[1] | e[2]) == 0) {
+                ix = palette_color_find(&I->palette, c, I->range);
+                if (ix != -1) {
+                    *dst = ix;
+                    continue;
+                }
+            }
+
+            switch (I->dither)
+            {
+            case Dither_Ordered:
+                t = (((i32)punp_bayer8_[((y & 7) << 3) | (x & 7)] - 32) * PUNP_DITHER_ORDERED_SPREAD) / 64;
+                ix = bitmap_import_nearest_(I, c.r + t, c.g + t, c.b + t);
+                break;
+
+            case Dither_Diffuse:
+                n = errors_next + ((x + 1) * 3);
+                // Clamped, so the errors stay within [-255, 255].
+                r = clamp(c.r + (e[0] / 16), 0, 255);
+                g = clamp(c.g + (e[1] / 16), 0, 255);
+                b = clamp(c.b + (e[2] / 16), 0, 255);
+                ix = bitmap_import_nearest_(I, r, g, b);
+                r -= colors[ix].r;
+                g -= colors[ix].g;
+                b -= colors[ix].b;
+                // Floyd-Steinberg (errors are stored multiplied by 16).
+                bitmap_import_error_add_(e + 3, r * 7, g * 7, b * 7);
+                bitmap_import_error_add_(n - 3, r * 3, g * 3, b * 3);
+                bitmap_import_error_add_(n,     r * 5, g * 5, b * 5);
+                bitmap_import_error_add_(n + 3, r,     g,     b);
+                break;
+
+            default:
+                ix = bitmap_import_nearest_(I, c.r, c.g, c.b);
+                break;
+            }
+            *dst = ix;
+        }
+
+        if (errors_cur) {
+            swap = errors_cur;
+            errors_cur = errors_next;
+            errors_next = swap;
+            memset(errors_next, 0, errors_pitch * sizeof(i16));
+        }
+    }
+}
+
+//
+// Bitmap registry
+//
+
+static u64
+hash_bytes_(u64 hash, const void *data, size_t size)
+{
+    const u8 *it = (const u8*)data;
+    u64 word;
+    for (; size >= 8; size -= 8, it += 8) {
+        memcpy(&word, it, 8);
+        hash = (hash ^ word) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+    }
+    for (; size; --size, ++it) {
+        hash = (hash ^ *it) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+void
+bitmap_registry_clear()
+{
+    memset(CORE->bitmap_registry, 0, sizeof(CORE->bitmap_registry));
+    CORE->bitmap_registry_count = 0;
+    CORE->bitmap_registry_top = 0;
+}
+
+#if PUNITY_BITMAP_DEDUPE
+
+static void
+bitmap_registry_insert_(u64 hash, u8 *pixels, u32 size)
+{
+    // Keep the table at most half full.
+    if (CORE->bitmap_registry_count == PUN_BITMAP_REGISTRY_SIZE / 2) {
+        return;
+    }
+    u32 mask = PUN_BITMAP_REGISTRY_SIZE - 1;
+    u32 i = (u32)hash & mask;
+    while (CORE->bitmap_registry[i].pixels) {
+        i = (i + 1) & mask;
+    }
+    CORE->bitmap_registry[i].hash = hash;
+    CORE->bitmap_registry[i].pixels = pixels;
+    CORE->bitmap_registry[i].size = size;
+    CORE->bitmap_registry_count++;
+    CORE->bitmap_registry_top = maximum(CORE->bitmap_registry_top, pixels + size);
+}
+
+// Forgets the shared pixels that are no longer in `bank` if it's `CORE->storage`.
+static void
+bitmap_registry_rewind_(Bank *bank)
+{
+    if (!CORE || bank != CORE->storage || bank->it >= CORE->bitmap_registry_top) {
+        return;
+    }
+
+    // Reinsert the entries that are still in storage.
+    BankState bank_state = bank_begin(CORE->stack);
+    BitmapShared *entries = bank_push_t(CORE->stack, BitmapShared, PUN_BITMAP_REGISTRY_SIZE);
+    memcpy(entries, CORE->bitmap_registry, sizeof(CORE->bitmap_registry));
+    bitmap_registry_clear();
+    for (i32 i = 0; i != PUN_BITMAP_REGISTRY_SIZE; ++i) {
+        if (entries[i].pixels && entries[i].pixels + entries[i].size <= bank->it) {
+            bitmap_registry_insert_(entries[i].hash, entries[i].pixels, entries[i].size);
+        }
+    }
+    bank_end(&bank_state);
+}
+
+// Returns shared pixels with the same content as `pixels`, or 0 if there are none.
+static u8 *
+bitmap_registry_find_(u64 hash, u8 *pixels, u32 size)
+{
+    u32 mask = PUN_BITMAP_REGISTRY_SIZE - 1;
+    BitmapShared *entry;
+    for (u32 i = (u32)hash & mask;; i = (i + 1) & mask) {
+        entry = CORE->bitmap_registry + i;
+        if (!entry->pixels) {
+            return 0;
+        }
+        if (entry->hash == hash && entry->size == size && memcmp(entry->pixels, pixels, size) == 0) {
+            return entry->pixels;
+        }
+    }
+}
+
+#endif // PUNITY_BITMAP_DEDUPE
+
+void
+bitmap_init_ex_(Bank *bank, Bitmap *bitmap, i32 width, i32 height, void *pixels, int bpp, int palette_range, const char *path)
+{
+    bitmap->width = width;
+    bitmap->pitch = align_to(width, 16);
+    bitmap->height = height;
+    bitmap->palette_range = palette_range;
+    bitmap->format = BitmapFormat_8;
+    bitmap->base = 0;
+    bitmap->animations = 0;
+
+    u32 size = bitmap->pitch * height;
+#if PUNITY_BITMAP_DEDUPE
+    if (pixels && bank == CORE->storage) {
+        // Convert in storage and give the memory back if the same pixels are already there.
+        BankState bank_state = bank_begin(bank);
+        bitmap->pixels = bank_push(bank, size);
+        memset(bitmap->pixels + width * height, 0, size - width * height);
+        if (bitmap_init_(bitmap, pixels, bpp, path)) {
+            u64 hash = hash_bytes_(14695981039346656037ull, bitmap->pixels, size);
+            u8 *shared = bitmap_registry_find_(hash, bitmap->pixels, size);
+            if (shared) {
+                bank_end(&bank_state);
+                bitmap->pixels = shared;
+            } else {
+                bitmap_registry_insert_(hash, bitmap->pixels, size);
+            }
+        }
+        return;
+    }
+#endif
     bitmap->pixels = bank_push(bank, size);
     bitmap_init_(bitmap, pixels, bpp, path);
 }
@@ -3095,6 +5625,41 @@ bitmap_init(Bitmap *bitmap, i32 width, i32 height, void *pixels, int bpp, int pa
     bitmap_init_ex_(CORE->storage, bitmap, width, height, pixels, bpp, palette_range, 0);
 }
 
+void
+bitmap_init_dithered(Bitmap *bitmap, i32 width, i32 height, void *pixels, int palette_range, int dither)
+{
+    bitmap_init_ex_(CORE->storage, bitmap, width, height, 0, PUN_BITMAP_8, palette_range, 0);
+    if (!pixels) {
+        return;
+    }
+
+    // Build the lookup and the cube now, so the workers only read the palette.
+    Palette *palette = CORE->palette;
+    if (palette_color_find_nearest(palette, color_make(0, 0, 0, 0xFF), palette_range) == -1) {
+        bitmap_clear(bitmap, 0);
+        return;
+    }
+    palette_lookup_update_(palette);
+
+    BankState bank_state = bank_begin(CORE->stack);
+
+    BitmapImport_ *I = bank_push_t(CORE->stack, BitmapImport_, 1);
+    I->palette = *palette;
+    I->cube = palette->cubes[palette_range];
+    I->range = palette_range;
+    I->dither = dither;
+    I->pixels = (Color*)pixels;
+    I->bitmap = bitmap;
+    I->errors = 0;
+    if (dither == Dither_Diffuse) {
+        I->errors = bank_push_t(CORE->stack, i16, cpu_count() * (width + 2) * 3 * 2);
+    }
+
+    parallel_for(ceil_div(height, PUNP_IMPORT_BAND_ROWS), 1, bitmap_import_band_, I);
+
+    bank_end(&bank_state);
+}
+
 void
 bitmap_clear(Bitmap *bitmap, u8 color)
 {
@@ -3137,6 +5702,21 @@ bitmap_load_resource(Bitmap *bitmap, const char *resource_name, int palette_rang
     bitmap_load_resource_ex(CORE->storage, bitmap, resource_name, palette_range);
 }
 
+void
+bitmap_load_resource_dithered(Bitmap *bitmap, const char *resource_name, int palette_range, int dither)
+{
+    size_t size;
+    void *ptr = resource_get(resource_name, &size);
+    ASSERT(ptr);
+    int width, height, comp;
+    Color *pixels = (Color *)stbi_load_from_memory(ptr, (int)size, &width, &height, &comp, STBI_rgb_alpha);
+    ASSERT(pixels);
+    ASSERT(comp == 4);
+
+    bitmap_init_dithered(bitmap, (i32)width, (i32)height, pixels, palette_range, dither);
+    free(pixels);
+}
+
 void
 font_load_resource(Bitmap *font, const char *resource_name, i32 tile_width, i32 tile_height)
 {
@@ -3157,6 +5737,300 @@ font_load_resource(Bitmap *font, const char *resource_name, i32 tile_width, i32
 
 #endif
 
+//
+// Atlas
+//
+
+void
+atlas_init(Atlas *atlas, i32 page_width, i32 page_height)
+{
+    memset(atlas, 0, sizeof(Atlas));
+    atlas->page_width = page_width;
+    atlas->page_height = page_height;
+}
+
+// Returns the `y` the rect would be placed at when placed at `nodes[index].x`, or -1 if it doesn't fit.
+static i32
+atlas_fit_(Atlas *atlas, AtlasNode *nodes, i32 nodes_count, i32 index, i32 width, i32 height)
+{
+    i32 x = nodes[index].x;
+    if (x + width > atlas->page_width) {
+        return -1;
+    }
+    i32 y = 0;
+    i32 right = x + width;
+    for (i32 i = index; i != nodes_count && nodes[i].x < right; ++i) {
+        y = maximum(y, nodes[i].y);
+    }
+    if (y + height > atlas->page_height) {
+        return -1;
+    }
+    return y;
+}
+
+static bool
+atlas_page_reserve_(Atlas *atlas, i32 page, i32 width, i32 height, Rect *rect)
+{
+    AtlasNode *nodes = atlas->nodes[page];
+    i32 count = atlas->nodes_count[page];
+
+    i32 best = -1;
+    i32 best_y = INT32_MAX;
+    for (i32 i = 0; i != count; ++i) {
+        i32 y = atlas_fit_(atlas, nodes, count, i, width, height);
+        if (y != -1 && y < best_y) {
+            best = i;
+            best_y = y;
+        }
+    }
+    if (best == -1) {
+        return false;
+    }
+
+    i32 x = nodes[best].x;
+    i32 right = x + width;
+    *rect = rect_make_size(x, best_y, width, height);
+
+    // Remove the nodes covered by the rect and cut the one it partially covers.
+    i32 end = best;
+    while (end != count && nodes[end].x + nodes[end].width <= right) {
+        ++end;
+    }
+    if (end != count && nodes[end].x < right) {
+        nodes[end].width -= right - nodes[end].x;
+        nodes[end].x = right;
+    }
+    memmove(nodes + best + 1, nodes + end, (count - end) * sizeof(AtlasNode));
+    count -= end - best - 1;
+    nodes[best].x = x;
+    nodes[best].y = best_y + height;
+    nodes[best].width = width;
+
+    // Merge neighbors at the same height.
+    i32 i = maximum(0, best - 1);
+    while (i + 1 < count) {
+        if (nodes[i].y == nodes[i + 1].y) {
+            nodes[i].width += nodes[i + 1].width;
+            memmove(nodes + i + 1, nodes + i + 2, (count - i - 2) * sizeof(AtlasNode));
+            --count;
+        } else if (i > best) {
+            break;
+        } else {
+            ++i;
+        }
+    }
+
+    atlas->nodes_count[page] = count;
+    return true;
+}
+
+bool
+atlas_reserve(Atlas *atlas, i32 width, i32 height, AtlasRegion *region)
+{
+    if (width > atlas->page_width || height > atlas->page_height) {
+        return false;
+    }
+
+    for (i32 page = 0; page != atlas->pages_count; ++page) {
+        if (atlas_page_reserve_(atlas, page, width, height, &region->rect)) {
+            region->page = atlas->pages[page];
+            return true;
+        }
+    }
+
+    if (atlas->pages_count == PUN_ATLAS_PAGES_MAX) {
+        return false;
+    }
+
+    i32 page = atlas->pages_count++;
+    atlas->pages[page] = bank_push_t(CORE->storage, Bitmap, 1);
+    bitmap_init_ex_(CORE->storage, atlas->pages[page], atlas->page_width, atlas->page_height, 0, PUN_BITMAP_8, 0, 0);
+    bitmap_clear(atlas->pages[page], PUN_COLOR_TRANSPARENT);
+
+    // Each rect adds at most one node.
+    atlas->nodes[page] = bank_push_t(CORE->storage, AtlasNode, atlas->page_width + 1);
+    atlas->nodes[page][0].x = 0;
+    atlas->nodes[page][0].y = 0;
+    atlas->nodes[page][0].width = atlas->page_width;
+    atlas->nodes_count[page] = 1;
+
+    bool reserved = atlas_page_reserve_(atlas, page, width, height, &region->rect);
+    ASSERT(reserved);
+    region->page = atlas->pages[page];
+    return true;
+}
+
+bool
+atlas_add(Atlas *atlas, Bitmap *bitmap, AtlasRegion *region)
+{
+    if (!atlas_reserve(atlas, bitmap->width, bitmap->height, region)) {
+        return false;
+    }
+
+    Bitmap *page = region->page;
+    u8 *src = bitmap->pixels;
+    u8 *dst = page->pixels + region->rect.min_x + (region->rect.min_y * page->width);
+    for (i32 y = 0; y != bitmap->height; ++y, src += bitmap->width, dst += page->width) {
+        memcpy(dst, src, bitmap->width);
+    }
+    return true;
+}
+
+#if PUNITY_USE_STB_IMAGE
+
+bool
+atlas_add_resource(Atlas *atlas, const char *resource_name, int palette_range, AtlasRegion *region)
+{
+    BankState bank_state = bank_begin(CORE->stack);
+    Bitmap bitmap;
+    bitmap_load_resource_ex(CORE->stack, &bitmap, resource_name, palette_range);
+    bool added = atlas_add(atlas, &bitmap, region);
+    bank_end(&bank_state);
+    return added;
+}
+
+#endif
+
+void
+atlas_region_draw(AtlasRegion *region, i32 x, i32 y, i32 pivot_x, i32 pivot_y)
+{
+    bitmap_draw(region->page, x, y, pivot_x, pivot_y, &region->rect);
+}
+
+DrawListItem *
+atlas_region_draw_push(AtlasRegion *region, i32 x, i32 y, i32 pivot_x, i32 pivot_y, i32 z)
+{
+    return bitmap_draw_push(region->page, x, y, pivot_x, pivot_y, &region->rect, z);
+}
+
+//
+// Present
+//
+
+void
+palette_expand(u32 *dst, u8 *src, size_t count, const Color *colors)
+{
+    const u32 *table = (const u32 *)colors;
+    size_t i = 0;
+#if PUNITY_SIMD_AVX2
+    __m256i mm;
+    for (; i + 8 <= count; i += 8) {
+        mm = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(src + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_i32gather_epi32((const int*)table, mm, 4));
+    }
+#endif
+    // Without AVX2 this loop does all the work, SSSE3 has no gathers
+    // and pshufb can only look up 16 entries.
+    for (; i != count; ++i) {
+        dst[i] = table[src[i]];
+    }
+}
+
+void
+present_init(Present *P, Bank *bank, i32 width, i32 height, i32 scale, int filter, bool flip)
+{
+    memset(P, 0, sizeof(Present));
+    P->width = width;
+    P->height = height;
+    P->scale = maximum(1, scale);
+    P->filter = filter;
+    P->flip = flip;
+    P->pixels_width  = width  * P->scale;
+    P->pixels_height = height * P->scale;
+    P->pixels = bank_push_t(bank, u32, P->pixels_width * P->pixels_height);
+    P->shadow = bank_push_t(bank, u8, width * height);
+    if (P->scale != 1) {
+        P->scaled.width  = P->pixels_width;
+        P->scaled.height = P->pixels_height;
+        P->scaled.pitch  = P->pixels_width;
+        P->scaled.pixels = bank_push_t(bank, u8, P->pixels_width * P->pixels_height);
+    }
+    P->invalid = true;
+}
+
+void
+present_invalidate(Present *P)
+{
+    P->invalid = true;
+}
+
+// Converts canvas rows from `min_y` to `max_y`.
+static void
+present_convert_(Present *P, Bitmap *canvas, i32 min_y, i32 max_y)
+{
+    u8 *src = canvas->pixels;
+    i32 src_width = P->width;
+    if (P->scale != 1) {
+        bitmap_scale_rows(&P->scaled, canvas, P->scale, P->filter, min_y, max_y);
+        src = P->scaled.pixels;
+        src_width = P->pixels_width;
+        min_y *= P->scale;
+        max_y *= P->scale;
+    }
+
+    src += min_y * src_width;
+    for (i32 y = min_y; y != max_y; ++y, src += src_width) {
+        palette_expand(P->pixels + (P->flip ? (P->pixels_height - 1 - y) : y) * P->pixels_width,
+            src, P->pixels_width, P->colors);
+    }
+}
+
+bool
+present_update(Present *P, Bitmap *canvas, const Color *colors)
+{
+    ASSERT(canvas->width == P->width && canvas->height == P->height);
+
+    if (memcmp(P->colors, colors, sizeof(P->colors)) != 0) {
+        memcpy(P->colors, colors, sizeof(P->colors));
+        P->invalid = true;
+    }
+
+    // EPX reads neighboring rows, so a changed row also changes the rows around it.
+    i32 spread = (P->scale != 1 && P->filter == ScaleFilter_EPX) ? 1 : 0;
+
+    i32 min_y = P->height;
+    i32 max_y = 0;
+    i32 run_min_y = 0;
+    i32 run_max_y = 0;
+    u8 *src = canvas->pixels;
+    u8 *shadow = P->shadow;
+    for (i32 y = 0; y != P->height; ++y, src += P->width, shadow += P->width)
+    {
+        if (!P->invalid && memcmp(src, shadow, P->width) == 0) {
+            continue;
+        }
+        memcpy(shadow, src, P->width);
+
+        // Join the changed rows to runs, so the scalers can work on more rows at once.
+        if (y - spread > run_max_y) {
+            present_convert_(P, canvas, run_min_y, run_max_y);
+            run_min_y = maximum(0, y - spread);
+        }
+        run_max_y = minimum(P->height, y + 1 + spread);
+
+        min_y = minimum(min_y, maximum(0, y - spread));
+        max_y = run_max_y;
+    }
+    present_convert_(P, canvas, run_min_y, run_max_y);
+    P->invalid = false;
+
+    if (max_y <= min_y) {
+        P->dirty_min_y = P->dirty_max_y = 0;
+        return false;
+    }
+
+    min_y *= P->scale;
+    max_y *= P->scale;
+    if (P->flip) {
+        P->dirty_min_y = P->pixels_height - max_y;
+        P->dirty_max_y = P->pixels_height - min_y;
+    } else {
+        P->dirty_min_y = min_y;
+        P->dirty_max_y = max_y;
+    }
+    return true;
+}
+
 //
 // Keys
 //
@@ -3179,8 +6053,7 @@ scene_init(Scene *S, i32 cell_size)
     S->cell_size = cell_size <= 7 ? 32 : cell_size;
     S->entities_count = 0;
 
-    // TODO: Use pow 2 bucket sizes and do & instead of %?
-    spatialhash_init(&S->hash, 5003);
+    spatialhash_init(&S->hash, 4096);
     deque_init(&S->entities_deque, sizeof(SceneEntity) * 256);
 }
 
@@ -3203,6 +6076,15 @@ scene_cell_range_for_rect(Rect rect, f32 cell_size, Rect *clip)
     return result;
 }
 
+void
+scene_init_grid(Scene *S, i32 cell_size, Rect bounds)
+{
+    scene_init(S, cell_size);
+    // The table is only used outside of the bounds, so it can start small.
+    spatialhash_free(&S->hash);
+    spatialhash_init_grid(&S->hash, 64, scene_cell_range_for_rect(bounds, S->cell_size, 0));
+}
+
 void
 scene_debug_cells(Scene *S, u8 color, i32 z)
 {
@@ -3231,32 +6113,61 @@ scene_debug_cells(Scene *S, u8 color, i32 z)
     }
 }
 
-bool
-scene_foreach(Scene *S, Rect rect, SceneForEachCallbackF *callback, void *data, i32 mask)
+static Rect
+scene_tile_range_for_rect_(TileMap *tilemap, Rect rect)
 {
-    Rect range;
-    i32 cx, cy, ci, tx, ty;
-    int flags;
+    Rect range = scene_cell_range_for_rect(rect, tilemap->tile_width, 0);
+    Rect range_y = scene_cell_range_for_rect(rect, tilemap->tile_height, 0);
+    range.min_y = range_y.min_y;
+    range.max_y = range_y.max_y;
+    return rect_clip(range, rect_make_size(0, 0, tilemap->width, tilemap->height));
+}
 
-    Tile *tile;
-    SpatialCell *cell;
-    SceneEntity **entity;
+static bool
+scene_foreach_tiles_(Scene *S, Rect rect, SceneForEachCallbackF *callback, void *data, i32 mask)
+{
+    Rect range;
+    i32 cx, cy;
     Rect box;
-    SceneEntity *tile_entity;
 
     SceneItem item;
-    if (S->tilemap)
+    if (S->tilemap && !S->tilemap->tiles)
     {
+        TileMap *tilemap = S->tilemap;
         item.type = SceneItem_Tile;
-        Rect tile_rect = rect_make_size(0, 0, S->tilemap->width, S->tilemap->height);
-        range = scene_cell_range_for_rect(rect, S->tilemap->tile_width, &tile_rect);
-        Tile *tile = &S->tilemap->tiles[range.min_y * S->tilemap->width];
-        for (cy = range.min_y; cy != range.max_y; ++cy) {
+        item.tile = &S->tile_copy;
+        range = scene_tile_range_for_rect_(tilemap, rect);
+        i32 row = range.min_y * tilemap->width;
+        for (cy = range.min_y; cy != range.max_y; ++cy, row += tilemap->width) {
+            u8 *edges = tilemap->edges + row;
             for (cx = range.min_x; cx != range.max_x; ++cx)
             {
-                item.tile = &tile[cx];
-                if ((item.tile->flags & Edge_All) && (mask & item.tile->layer) != 0) {
-                    box = rect_make_size(cx * S->tilemap->tile_width, cy * S->tilemap->tile_height,
+                if ((edges[cx] & Edge_All) && (mask & tilemap->layers[row + cx]) != 0) {
+                    TileDef *def = tilemap->defs + tilemap->ids[row + cx];
+                    S->tile_copy.tileset = def->tileset;
+                    S->tile_copy.index = def->index;
+                    S->tile_copy.flags = edges[cx];
+                    S->tile_copy.layer = tilemap->layers[row + cx];
+                    box = rect_make_size(cx * tilemap->tile_width, cy * tilemap->tile_height,
+                        tilemap->tile_width, tilemap->tile_height);
+                    if (callback(S, &rect, &box, (edges[cx] & Edge_All) | EntityFlag_Tile, &item, data)) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    else if (S->tilemap)
+    {
+        item.type = SceneItem_Tile;
+        range = scene_tile_range_for_rect_(S->tilemap, rect);
+        Tile *tile = &S->tilemap->tiles[range.min_y * S->tilemap->width];
+        for (cy = range.min_y; cy != range.max_y; ++cy) {
+            for (cx = range.min_x; cx != range.max_x; ++cx)
+            {
+                item.tile = &tile[cx];
+                if ((item.tile->flags & Edge_All) && (mask & item.tile->layer) != 0) {
+                    box = rect_make_size(cx * S->tilemap->tile_width, cy * S->tilemap->tile_height,
                         S->tilemap->tile_width, S->tilemap->tile_height);
                     if (callback(S, &rect, &box, (item.tile->flags & Edge_All) | EntityFlag_Tile, &item, data)) {
                         return true;
@@ -3266,29 +6177,120 @@ scene_foreach(Scene *S, Rect rect, SceneForEachCallbackF *callback, void *data,
             tile += S->tilemap->width;
         }
     }
+    return false;
+}
+
+// Starts a new query and returns its stamp.
+static u32
+scene_query_begin_(Scene *S)
+{
+    if (++S->query == 0) {
+        // Wrapped around, clear old stamps so they can't match the new ones.
+        for (SceneEntity *entity = S->entities; entity; entity = entity->next) {
+            entity->query = 0;
+        }
+        S->query = 1;
+    }
+    return S->query;
+}
+
+// Returns the dense grid row for `cy` if the whole `range` is in the grid, NULL otherwise.
+static inline SpatialCell **
+scene_grid_row_(Scene *S, Rect *range, i32 cy)
+{
+    Rect *grid_rect = &S->hash.grid_rect;
+    if (S->hash.grid &&
+        range->min_x >= grid_rect->min_x && range->max_x <= grid_rect->max_x &&
+        range->min_y >= grid_rect->min_y && range->max_y <= grid_rect->max_y)
+    {
+        return S->hash.grid + (cy - grid_rect->min_y) * rect_width(grid_rect);
+    }
+    return 0;
+}
+
+static bool
+scene_foreach_entities_(Scene *S, Rect rect, SceneForEachCallbackF *callback, void *data, i32 mask)
+{
+    Rect range;
+    i32 cx, cy, ci;
+    SpatialCell *cell, **row;
+    SceneEntity *entity;
+    u32 query = scene_query_begin_(S);
 
+    SceneItem item;
     item.type = SceneItem_Entity;
     range = scene_cell_range_for_rect(rect, S->cell_size, &S->hash.rect);
-    for (cy = range.min_y; cy != range.max_y; ++cy) {
-        for (cx = range.min_x; cx != range.max_x; ++cx) {
-            cell = spatialhash_get_cell(&S->hash, cx, cy);
-            while (cell && (cell->x == cx && cell->y == cy)) {
-                entity = (SceneEntity**)cell->items;
-                for (ci = 0; ci < cell->items_count; ++ci, ++entity)
+    for (cy = range.min_y; cy < range.max_y; ++cy) {
+        // Whole range in the dense grid is indexed directly.
+        row = scene_grid_row_(S, &range, cy);
+        for (cx = range.min_x; cx < range.max_x; ++cx) {
+            cell = row ? row[cx - S->hash.grid_rect.min_x] : spatialhash_get_cell(&S->hash, cx, cy);
+            for (; cell; cell = cell->next) {
+                for (ci = 0; ci < cell->items_count; ++ci)
                 {
-                    item.entity = *entity;
-                    if ((mask & item.entity->layer) != 0 && callback(S, &rect, &item.entity->box, item.entity->flags, &item, data)) {
+                    entity = cell->items[ci];
+                    if (entity->query == query || (mask & entity->layer) == 0) {
+                        continue;
+                    }
+                    entity->query = query;
+                    item.entity = entity;
+                    if (callback(S, &rect, &entity->box, entity->flags, &item, data)) {
                         return true;
                     }
                 }
-                cell = cell->next;
-           }
+            }
         }
     }
 
     return false;
 }
 
+i32
+scene_query(Scene *S, Rect rect, i32 mask, SceneItem *items, i32 items_max)
+{
+    Rect range;
+    i32 cx, cy, ci;
+    SpatialCell *cell, **row;
+    SceneEntity *entity;
+    u32 query = scene_query_begin_(S);
+    i32 count = 0;
+
+    range = scene_cell_range_for_rect(rect, S->cell_size, &S->hash.rect);
+    for (cy = range.min_y; cy < range.max_y; ++cy) {
+        row = scene_grid_row_(S, &range, cy);
+        for (cx = range.min_x; cx < range.max_x; ++cx) {
+            cell = row ? row[cx - S->hash.grid_rect.min_x] : spatialhash_get_cell(&S->hash, cx, cy);
+            for (; cell; cell = cell->next) {
+                for (ci = 0; ci < cell->items_count; ++ci)
+                {
+                    entity = cell->items[ci];
+                    if (entity->query == query || (mask & entity->layer) == 0) {
+                        continue;
+                    }
+                    entity->query = query;
+                    if (!rect_overlaps(rect, entity->box)) {
+                        continue;
+                    }
+                    if (count < items_max) {
+                        items[count].type = SceneItem_Entity;
+                        items[count].entity = entity;
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+bool
+scene_foreach(Scene *S, Rect rect, SceneForEachCallbackF *callback, void *data, i32 mask)
+{
+    return scene_foreach_tiles_(S, rect, callback, data, mask)
+        || scene_foreach_entities_(S, rect, callback, data, mask);
+}
+
 static inline bool
 scene_entity_cast_f_xy_(SceneEntity *A, SceneItem *B, i32 flags,
     Collision *C,
@@ -3374,6 +6376,81 @@ rect_dilate_(Rect rect, i32 mx, i32 my) {
     return rect;
 }
 
+static inline i32
+floor_div_(i32 n, i32 d)
+{
+    return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+
+// Finds the nearest tile hit by moving `A` by `C->mx` (or `C->my` if `vertical`),
+// same as `scene_entity_cast_f_xy_` would for each tile, and shortens the move.
+static void
+scene_entity_cast_tiles_(Scene *S, SceneEntity *A, Collision *C, bool vertical)
+{
+    TileMap *T = S->tilemap;
+    i32 *m = vertical ? &C->my : &C->mx;
+    // Along the movement.
+    i32 size    = vertical ? T->tile_height : T->tile_width;
+    i32 count   = vertical ? T->height : T->width;
+    i32 a_min   = vertical ? A->box.min_y : A->box.min_x;
+    i32 a_max   = vertical ? A->box.max_y : A->box.max_x;
+    // Across the movement.
+    i32 s_size  = vertical ? T->tile_width : T->tile_height;
+    i32 s_count = vertical ? T->width : T->height;
+    i32 s_min   = vertical ? A->box.min_x : A->box.min_y;
+    i32 s_max   = vertical ? A->box.max_x : A->box.max_y;
+
+    i32 line_min = maximum(0, floor_div_(s_min, s_size));
+    i32 line_max = minimum(s_count, -floor_div_(-s_max, s_size));
+    i32 hit_line = -1, hit = -1;
+
+    if (*m > 0)
+    {
+        // Tiles with min edge in [a_max, a_max + m).
+        i32 edge = vertical ? Edge_Top : Edge_Left;
+        i32 from = maximum(0, -floor_div_(-a_max, size));
+        i32 to   = -floor_div_(-(a_max + *m), size);
+        for (i32 line = line_min; line < line_max && from < to; ++line) {
+            i32 i = tilemap_solid_find(T, edge, line, from, to, A->mask);
+            if (i != -1) {
+                // Only nearer tiles from now on, ties go to the first line.
+                hit = i; hit_line = line; to = i;
+            }
+        }
+        if (hit != -1) {
+            *m = hit * size - a_max;
+        }
+    }
+    else
+    {
+        // Tiles with max edge in (a_min + m, a_min].
+        i32 edge = vertical ? Edge_Bottom : Edge_Right;
+        i32 from = minimum(count, floor_div_(a_min, size)) - 1;
+        i32 to   = floor_div_(a_min + *m, size) - 1;
+        for (i32 line = line_min; line < line_max && from > to; ++line) {
+            i32 i = tilemap_solid_find(T, edge, line, from, to, A->mask);
+            if (i != -1) {
+                hit = i; hit_line = line; to = i;
+            }
+        }
+        if (hit != -1) {
+            *m = -(a_min - (hit + 1) * size);
+        }
+    }
+
+    if (hit != -1) {
+        i32 x = vertical ? hit_line : hit;
+        i32 y = vertical ? hit : hit_line;
+        C->B.type = SceneItem_Tile;
+        if (T->tiles) {
+            C->B.tile = T->tiles + x + y * T->width;
+        } else {
+            S->tile_copy = tilemap_tile_get(T, x, y);
+            C->B.tile = &S->tile_copy;
+        }
+    }
+}
+
 // Returns false if entity cannot move full delta (hits an obstacle).
 static inline bool
 scene_entity_cast_xy_(Scene *S, SceneEntity *A, f32 dx, f32 dy, Collision *C, SceneForEachCallbackF *f)
@@ -3387,9 +6464,22 @@ scene_entity_cast_xy_(Scene *S, SceneEntity *A, f32 dx, f32 dy, Collision *C, Sc
 
     C->A = A;
 
-    C->box = rect_dilate_(A->box, C->mx, C->my);
-    // printf("-- foreach\n");
-    scene_foreach(S, C->box, f, C, A->mask);
+    if (S->tilemap && S->tilemap->solid[0])
+    {
+        // Sweep the tiles with bitsets and the entities only up to the first tile hit.
+        scene_entity_cast_tiles_(S, A, C, C->my != 0);
+        if (C->mx == 0 && C->my == 0) {
+            return false;
+        }
+        C->box = rect_dilate_(A->box, C->mx, C->my);
+        scene_foreach_entities_(S, C->box, f, C, A->mask);
+    }
+    else
+    {
+        C->box = rect_dilate_(A->box, C->mx, C->my);
+        // printf("-- foreach\n");
+        scene_foreach(S, C->box, f, C, A->mask);
+    }
 
     return C->B.type == SceneItem_None;
 }
@@ -3466,10 +6556,25 @@ scene_entity_add(Scene *S, Rect box, i32 layer, i32 mask)
     entity->flags = Edge_All;
     entity->layer = layer;
     entity->mask = mask;
+    S->entities_count++;
 
     Rect range = scene_cell_range_for_rect(entity->box, S->cell_size, 0);
     spatialhash_add(&S->hash, range, entity);
 
+    // Appended to the end, `scene_overlaps_all` sorts it to its place.
+    if (S->sorted_count == S->sorted_max) {
+        i32 sorted_max = maximum(256, S->sorted_max * 2);
+        SceneEntity **sorted = virtual_alloc(0, sorted_max * sizeof(SceneEntity*));
+        if (S->sorted) {
+            memcpy(sorted, S->sorted, S->sorted_count * sizeof(SceneEntity*));
+            virtual_free(S->sorted, S->sorted_max * sizeof(SceneEntity*));
+        }
+        S->sorted = sorted;
+        S->sorted_max = sorted_max;
+    }
+    entity->sorted_index = S->sorted_count;
+    S->sorted[S->sorted_count++] = entity;
+
     return entity;
 }
 
@@ -3503,10 +6608,62 @@ scene_entity_remove(Scene *S, SceneEntity *entity)
     S->entities_pool = entity;
     S->entities_count--;
 
+    // Moves the last entity to the hole, `scene_overlaps_all` sorts it back.
+    ASSERT(S->sorted[entity->sorted_index] == entity);
+    SceneEntity *last = S->sorted[--S->sorted_count];
+    S->sorted[entity->sorted_index] = last;
+    last->sorted_index = entity->sorted_index;
+
     Rect range = scene_cell_range_for_rect(entity->box, S->cell_size, 0);
     spatialhash_remove(&S->hash, range, entity);
 }
 
+bool
+scene_overlaps_all(Scene *S, SceneOverlapCallbackF *callback, void *data)
+{
+    SceneEntity **sorted = S->sorted;
+    SceneEntity *a, *b;
+    i32 i, j;
+
+    // Insertion sort by `min_x`, entities are mostly sorted from the previous call.
+    for (i = 1; i < S->sorted_count; ++i)
+    {
+        a = sorted[i];
+        for (j = i; j != 0 && sorted[j - 1]->box.min_x > a->box.min_x; --j) {
+            sorted[j] = sorted[j - 1];
+            sorted[j]->sorted_index = j;
+        }
+        if (j != i) {
+            sorted[j] = a;
+            a->sorted_index = j;
+        }
+    }
+
+    // Sweep, only the following entities starting before `a` ends can overlap it.
+    for (i = 0; i < S->sorted_count; ++i)
+    {
+        a = sorted[i];
+        for (j = i + 1; j < S->sorted_count; ++j)
+        {
+            b = sorted[j];
+            if (b->box.min_x >= a->box.max_x) {
+                break;
+            }
+            if (b->box.min_y >= a->box.max_y || a->box.min_y >= b->box.max_y ||
+                b->box.max_x <= a->box.min_x) {
+                continue;
+            }
+            if (((a->mask & b->layer) | (b->mask & a->layer)) == 0) {
+                continue;
+            }
+            if (callback(S, a, b, data)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 //
 //
 //
@@ -3525,22 +6682,102 @@ spatialhash_init(SpatialHash *H, size_t buckets_count)
     ASSERT(buckets_count);
 
     memset(H, 0, sizeof(SpatialHash));
-    H->buckets_count = buckets_count;
+    H->slots_count = 16;
+    H->slots_shift = 28;
+    while (H->slots_count < buckets_count) {
+        H->slots_count <<= 1;
+        H->slots_shift--;
+    }
+
+    H->slots = virtual_alloc(0, H->slots_count * sizeof(SpatialSlot));
+    memset(H->slots, 0, H->slots_count * sizeof(SpatialSlot));
 
-    H->buckets = virtual_alloc(0, H->buckets_count * sizeof(SpatialCell*));
-    memset(H->buckets, 0, buckets_count * sizeof(SpatialCell*));
-    
     deque_init(&H->cells, sizeof(SpatialCell) * 256);
 }
 
+void
+spatialhash_init_grid(SpatialHash *H, size_t buckets_count, Rect grid_rect)
+{
+    spatialhash_init(H, buckets_count);
+    H->grid_rect = grid_rect;
+    size_t size = rect_width(&grid_rect) * rect_height(&grid_rect) * sizeof(SpatialCell*);
+    if (size) {
+        H->grid = virtual_alloc(0, size);
+        memset(H->grid, 0, size);
+    }
+}
+
 void
 spatialhash_free(SpatialHash *H)
 {
-    virtual_free(H->buckets, H->buckets_count * sizeof(SpatialCell*));
+    if (H->grid) {
+        virtual_free(H->grid, rect_width(&H->grid_rect) * rect_height(&H->grid_rect) * sizeof(SpatialCell*));
+    }
+    virtual_free(H->slots, H->slots_count * sizeof(SpatialSlot));
     deque_free(&H->cells);
     memset(H, 0, sizeof(SpatialHash));
 }
 
+// Returns the slot with `x` and `y` or the empty slot where it should be added.
+static inline SpatialSlot *
+spatialhash_find_(SpatialHash *H, i32 x, i32 y)
+{
+    size_t mask = H->slots_count - 1;
+    size_t i = spatialhash_bucket(H, spatialhash_hash(x, y));
+    SpatialSlot *slot = H->slots + i;
+    while (slot->cell && (slot->x != x || slot->y != y)) {
+        i = (i + 1) & mask;
+        slot = H->slots + i;
+    }
+    return slot;
+}
+
+static void
+spatialhash_grow_(SpatialHash *H)
+{
+    SpatialSlot *slots = H->slots;
+    size_t slots_count = H->slots_count;
+
+    H->slots_count <<= 1;
+    H->slots_shift--;
+    H->slots = virtual_alloc(0, H->slots_count * sizeof(SpatialSlot));
+    memset(H->slots, 0, H->slots_count * sizeof(SpatialSlot));
+    for (size_t i = 0; i != slots_count; ++i) {
+        if (slots[i].cell) {
+            *spatialhash_find_(H, slots[i].x, slots[i].y) = slots[i];
+        }
+    }
+    virtual_free(slots, slots_count * sizeof(SpatialSlot));
+}
+
+// Empties the slot and shifts back the following slots of the probe sequence,
+// so that lookups don't need tombstones.
+static void
+spatialhash_slot_remove_(SpatialHash *H, SpatialSlot *slot)
+{
+    size_t mask = H->slots_count - 1;
+    size_t i = slot - H->slots;
+    size_t j = i;
+    size_t k;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (!H->slots[j].cell) {
+            break;
+        }
+        // Move the slot `j` to the hole at `i` unless its ideal position `k`
+        // lies cyclically in (i, j].
+        k = spatialhash_bucket(H, spatialhash_hash(H->slots[j].x, H->slots[j].y));
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        H->slots[i] = H->slots[j];
+        i = j;
+    }
+    H->slots[i].cell = 0;
+    H->slots_used--;
+}
+
 static inline SpatialCell *
 spatialhash_new_cell_(SpatialHash *H, i32 x, i32 y, SpatialCell *next)
 {
@@ -3558,51 +6795,80 @@ spatialhash_new_cell_(SpatialHash *H, i32 x, i32 y, SpatialCell *next)
     return cell;
 }
 
-void
-spatialhash_add(SpatialHash *H, Rect range, void *item)
+// Returns the grid entry for `x` and `y`, or NULL if there's no grid or the cell is outside.
+static inline SpatialCell **
+spatialhash_grid_get_(SpatialHash *H, i32 x, i32 y)
+{
+    if (H->grid &&
+        x >= H->grid_rect.min_x && x < H->grid_rect.max_x &&
+        y >= H->grid_rect.min_y && y < H->grid_rect.max_y)
+    {
+        return H->grid + (x - H->grid_rect.min_x) + (y - H->grid_rect.min_y) * rect_width(&H->grid_rect);
+    }
+    return 0;
+}
+
+static inline void
+spatialhash_add_at_(SpatialHash *H, i32 x, i32 y, void *item)
+{
+    SpatialCell **first = spatialhash_grid_get_(H, x, y);
+    if (!first)
+    {
+        SpatialSlot *slot = spatialhash_find_(H, x, y);
+        if (!slot->cell)
+        {
+            if ((H->slots_used + 1) * 100 > H->slots_count * PUN_SPATIALHASH_LOAD) {
+                spatialhash_grow_(H);
+                slot = spatialhash_find_(H, x, y);
+            }
+            slot->x = x;
+            slot->y = y;
+            slot->cell = spatialhash_new_cell_(H, x, y, 0);
+            H->slots_used++;
+        }
+        first = &slot->cell;
+    }
+
+    // Find a cell at x, y that is not full.
+    SpatialCell *cell = *first;
+    while (cell && cell->items_count == array_count(cell->items)) {
+        cell = cell->next;
+    }
+    if (!cell) {
+        // All cells are full, add a new one to the start.
+        cell = *first = spatialhash_new_cell_(H, x, y, *first);
+    }
+
+    cell->items[cell->items_count] = item;
+    cell->items_count++;
+}
+
+static inline void
+spatialhash_rect_extend_(SpatialHash *H, Rect range)
 {
     H->rect.min_x = minimum(H->rect.min_x, range.min_x);
     H->rect.min_y = minimum(H->rect.min_y, range.min_y);
     H->rect.max_x = maximum(H->rect.max_x, range.max_x);
     H->rect.max_y = maximum(H->rect.max_y, range.max_y);
+}
+
+void
+spatialhash_add(SpatialHash *H, Rect range, void *item)
+{
+    spatialhash_rect_extend_(H, range);
 
-    size_t bucket_index;
     i32 x, y;
-    SpatialCell **bucket;
-    SpatialCell *cell;
     for (y = range.min_y; y != range.max_y; ++y) {
-        for (x = range.min_x; x != range.max_x; ++x)
-        {
-            bucket_index = spatialhash_bucket(H, spatialhash_hash(x, y));
-            bucket = H->buckets + bucket_index;
-
-            // Find a cell in the bucket at x, y. Skip those that are full.
-            cell = *bucket;
-            while (cell && (cell->x != x || cell->y != y || cell->items_count == array_count(cell->items))) {
-                cell = cell->next;
-            }
-
-            if (!cell) {
-                // If there's no cell for x and y, we need to add a new one to
-                // the start of the bucket.
-                cell = *bucket = spatialhash_new_cell_(H, x, y, *bucket);
-            } else if (cell->items_count == array_count(cell->items)) {
-                // Otherwise, we only add a new cell if the cell we found is already
-                // full. We add it before the full one we found.
-                cell = spatialhash_new_cell_(H, x, y, cell);
-            }
-
-            cell->items[cell->items_count] = item;
-            cell->items_count++;
+        for (x = range.min_x; x != range.max_x; ++x) {
+            spatialhash_add_at_(H, x, y, item);
         }
     }
 }
 
+// `first` points to the first cell at the location, `slot` is NULL for grid cells.
 static void
-spatialhash_remove_(SpatialHash *H, SpatialCell *cell, u32 index, SpatialCell *previous, SpatialCell **bucket)
+spatialhash_remove_(SpatialHash *H, SpatialSlot *slot, SpatialCell **first, SpatialCell *cell, u32 index, SpatialCell *previous)
 {
-    // static counter = 0;
-    // counter++;
     ASSERT(cell->items_count != 0);
     if (cell->items_count != 1) {
         cell->items[index] = cell->items[cell->items_count - 1];
@@ -3611,23 +6877,38 @@ spatialhash_remove_(SpatialHash *H, SpatialCell *cell, u32 index, SpatialCell *p
 
     if (cell->items_count == 0)
     {
-        if (previous)
-        {
+        if (previous) {
             previous->next = cell->next;
-        }
-        else
-        {
-            // No previous cell, so we're the first cell in the bucket.
-            if (cell->next == 0) {
-                // No next. Empty the bucket.
-                *bucket = 0;
-            } else {
-                // We have a next cell, so we set that to be the first.
-                *bucket = cell->next;
-            }
+        } else {
+            *first = cell->next;
         }
         cell->next = H->pool;
         H->pool = cell;
+
+        if (slot && !slot->cell) {
+            spatialhash_slot_remove_(H, slot);
+        }
+    }
+}
+
+static inline void
+spatialhash_remove_at_(SpatialHash *H, i32 x, i32 y, void *item)
+{
+    u32 i;
+    SpatialSlot *slot = 0;
+    SpatialCell **first = spatialhash_grid_get_(H, x, y);
+    if (!first) {
+        slot = spatialhash_find_(H, x, y);
+        first = &slot->cell;
+    }
+    SpatialCell *cell, *previous = 0;
+    for (cell = *first; cell; previous = cell, cell = cell->next) {
+        for (i = 0; i != cell->items_count; ++i) {
+            if (cell->items[i] == item) {
+                spatialhash_remove_(H, slot, first, cell, i, previous);
+                return;
+            }
+        }
     }
 }
 
@@ -3635,32 +6916,34 @@ void
 spatialhash_remove(SpatialHash *H, Rect range, void *item)
 {
     i32 x, y;
-    u32 i;
-    SpatialCell *cell, *previous, **bucket;
     for (y = range.min_y; y != range.max_y; ++y) {
-        for (x = range.min_x; x != range.max_x; ++x)
-        {
-            bucket = H->buckets + spatialhash_bucket(H, spatialhash_hash(x, y));
-            cell = *bucket;
-            previous = 0;
-            while (cell && (cell->x != x || cell->y != y)) {
-                previous = cell;
-                cell = cell->next;
-            }
+        for (x = range.min_x; x != range.max_x; ++x) {
+            spatialhash_remove_at_(H, x, y, item);
+        }
+    }
+}
 
-            if (cell)
-            {
-                do {
-                    for (i = 0; i != cell->items_count; ++i) {
-                        if (cell->items[i] == item) {
-                            spatialhash_remove_(H, cell, i, previous, bucket);
-                            goto next;
-                        }
-                    }
-                    cell = cell->next;
-                } while (cell && (cell->x == x && cell->y == y));
-            }
-next:;
+// Adds or removes the `item` in cells of `range` that are not in `skip`.
+static void
+spatialhash_difference_(SpatialHash *H, Rect range, Rect skip, void *item, bool add)
+{
+    i32 x, y, skip_min_x, skip_max_x;
+    for (y = range.min_y; y < range.max_y; ++y)
+    {
+        if (y >= skip.min_y && y < skip.max_y) {
+            // Only the cells left and right of `skip` on this row.
+            skip_min_x = maximum(range.min_x, minimum(range.max_x, skip.min_x));
+            skip_max_x = minimum(range.max_x, maximum(range.min_x, skip.max_x));
+        } else {
+            skip_min_x = skip_max_x = range.max_x;
+        }
+        for (x = range.min_x; x < skip_min_x; ++x) {
+            if (add) spatialhash_add_at_(H, x, y, item);
+            else     spatialhash_remove_at_(H, x, y, item);
+        }
+        for (x = skip_max_x; x < range.max_x; ++x) {
+            if (add) spatialhash_add_at_(H, x, y, item);
+            else     spatialhash_remove_at_(H, x, y, item);
         }
     }
 }
@@ -3673,9 +6956,10 @@ spatialhash_update(SpatialHash *H, void *item, Rect old_range, Rect new_range)
         (old_range.max_x != new_range.max_x) ||
         (old_range.max_y != new_range.max_y))
     {
-        // TODO: Is it worth to optimize this?
-        spatialhash_remove(H, old_range, item);
-        spatialhash_add(H, new_range, item);
+        // Only cells the item leaves or enters are touched.
+        spatialhash_rect_extend_(H, new_range);
+        spatialhash_difference_(H, old_range, new_range, item, false);
+        spatialhash_difference_(H, new_range, old_range, item, true);
     }
 }
 
@@ -3685,14 +6969,8 @@ spatialhash_get_cell(SpatialHash *H, int x, int y)
     if (x >= H->rect.min_x && x < H->rect.max_x &&
         y >= H->rect.min_y && y < H->rect.max_y)
     {
-        SpatialCell **bucket = H->buckets + spatialhash_bucket(H, spatialhash_hash(x, y));
-
-        // Find a cell in the bucket at x, y that is not full.
-        SpatialCell *cell = *bucket;
-        while (cell && (cell->x != x || cell->y != y)) {
-            cell = cell->next;
-        }
-        return cell;
+        SpatialCell **first = spatialhash_grid_get_(H, x, y);
+        return first ? *first : spatialhash_find_(H, x, y)->cell;
     }
     return 0;
 }
@@ -3712,6 +6990,119 @@ tilemap_init(TileMap *tilemap, i32 width, i32 height, i32 tile_width, i32 tile_h
     tilemap->tile_height = tile_height;
 }
 
+static void
+tilemap_planes_alloc_(TileMap *tilemap)
+{
+    i32 count = tilemap->width * tilemap->height;
+    tilemap->ids = bank_push_t(CORE->storage, u16, count);
+    tilemap->edges = bank_push_t(CORE->storage, u8, count);
+    tilemap->layers = bank_push_t(CORE->storage, u8, count);
+    memset(tilemap->ids, 0, count * sizeof(u16));
+    memset(tilemap->edges, 0, count);
+    memset(tilemap->layers, 0, count);
+    tilemap->tiles = 0;
+}
+
+static void
+tilemap_defs_alloc_(TileMap *tilemap, i32 defs_max)
+{
+    ASSERT(defs_max > 0 && defs_max <= 0x10000);
+    // First definition is the empty tile.
+    tilemap->defs = bank_push_t(CORE->storage, TileDef, defs_max);
+    memset(tilemap->defs, 0, sizeof(TileDef));
+    tilemap->defs_count = 1;
+    tilemap->defs_max = defs_max;
+}
+
+void
+tilemap_init_compact(TileMap *tilemap, i32 width, i32 height, i32 tile_width, i32 tile_height, i32 defs_max)
+{
+    memset(tilemap, 0, sizeof(TileMap));
+    tilemap->width = width;
+    tilemap->height = height;
+    tilemap->tile_width = tile_width;
+    tilemap->tile_height = tile_height;
+    tilemap_planes_alloc_(tilemap);
+    tilemap_defs_alloc_(tilemap, defs_max);
+}
+
+u16
+tilemap_def_acquire(TileMap *tilemap, Bitmap *tileset, i32 index)
+{
+    if (!tileset) {
+        return 0;
+    }
+    TileDef *def = tilemap->defs + 1;
+    for (i32 i = 1; i != tilemap->defs_count; ++i, ++def) {
+        if (def->tileset == tileset && def->index == index) {
+            return (u16)i;
+        }
+    }
+    ASSERT_MESSAGE(tilemap->defs_count != tilemap->defs_max, "Tilemap is out of tile definitions.");
+    def->tileset = tileset;
+    def->index = index;
+    return (u16)tilemap->defs_count++;
+}
+
+void
+tilemap_compact(TileMap *tilemap)
+{
+    ASSERT(tilemap->tiles);
+    Tile *tiles = tilemap->tiles;
+    i32 count = tilemap->width * tilemap->height;
+    tilemap_planes_alloc_(tilemap);
+
+    // Distinct tiles are counted first, so the definitions take only the memory they need.
+    // There can be at most 0x10000 of them, so the table is never more than half full.
+    BankState bank_state = bank_begin(CORE->stack);
+    u32 capacity = 16;
+    while (capacity < (u32)count * 2 && capacity < 0x20000) {
+        capacity *= 2;
+    }
+    u32 mask = capacity - 1;
+    TileDef *found = bank_push_t(CORE->stack, TileDef, capacity);
+    u16 *found_ids = bank_push_t(CORE->stack, u16, capacity);
+    memset(found, 0, capacity * sizeof(TileDef));
+    i32 defs_count = 1;
+
+    Tile *tile = tiles;
+    for (i32 i = 0; i != count; ++i, ++tile)
+    {
+        tilemap->edges[i] = (u8)tile->flags;
+        tilemap->layers[i] = (u8)tile->layer;
+        if (!tile->tileset) {
+            continue;
+        }
+        u32 key = (u32)(((uintptr_t)tile->tileset >> 4) * 31 + tile->index) * 2654435761u;
+        TileDef *f;
+        u32 j;
+        for (j = key & mask;; j = (j + 1) & mask) {
+            f = found + j;
+            if (!f->tileset || (f->tileset == tile->tileset && f->index == tile->index)) {
+                break;
+            }
+        }
+        if (!f->tileset) {
+            ASSERT_MESSAGE(defs_count != 0x10000, "Tilemap has too many distinct tiles.");
+            f->tileset = tile->tileset;
+            f->index = tile->index;
+            found_ids[j] = (u16)defs_count++;
+        }
+        tilemap->ids[i] = found_ids[j];
+    }
+
+    // Leave some room for tiles set later.
+    tilemap_defs_alloc_(tilemap, minimum(0x10000, defs_count + defs_count / 2 + 16));
+    for (u32 j = 0; j != capacity; ++j) {
+        if (found[j].tileset) {
+            tilemap->defs[found_ids[j]] = found[j];
+        }
+    }
+    tilemap->defs_count = defs_count;
+
+    bank_end(&bank_state);
+}
+
 bool
 tilemap_get_draw_range(TileMap *tilemap, Rect *range)
 {
@@ -3723,7 +7114,7 @@ tilemap_get_draw_range(TileMap *tilemap, Rect *range)
     r.min_x = maximum(0, t);
     t = ((r.min_y) / (i32)tilemap->tile_height);
     r.min_y = maximum(0, t);
-    if (r.min_x < (tilemap->tile_width * tilemap->width) && r.min_y < (tilemap->tile_height * tilemap->height))
+    if (r.min_x < tilemap->width && r.min_y < tilemap->height)
     {
         t = ceil_div(r.max_x, tilemap->tile_width);
         r.max_x = minimum((i32)tilemap->width,  t);
@@ -3735,28 +7126,827 @@ tilemap_get_draw_range(TileMap *tilemap, Rect *range)
             return 1;
         }
     }
-    return 0;
+    return 0;
+}
+
+typedef struct
+{
+    // Tile as found in the map.
+    Bitmap *tileset;
+    i32 index;
+    // Tile with the same pixels it's replaced with.
+    Bitmap *unique_tileset;
+    i32 unique_index;
+}
+TileMapDedupe_;
+
+typedef struct
+{
+    u64 hash;
+    Bitmap *tileset;
+    i32 index;
+}
+TileMapUnique_;
+
+static bool
+tilemap_tiles_equal_(Bitmap *a, i32 a_index, Bitmap *b, i32 b_index)
+{
+    Rect ra = tile_get(a, a_index);
+    Rect rb = tile_get(b, b_index);
+    if (rect_width(&ra) != rect_width(&rb) || rect_height(&ra) != rect_height(&rb)) {
+        return false;
+    }
+    u8 *pa = a->pixels + ra.min_x + ra.min_y * a->width;
+    u8 *pb = b->pixels + rb.min_x + rb.min_y * b->width;
+    for (i32 y = 0; y != rect_height(&ra); ++y, pa += a->width, pb += b->width) {
+        if (memcmp(pa, pb, rect_width(&ra)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline u32
+tilemap_dedupe_key_(Bitmap *tileset, i32 index)
+{
+    return (u32)(((uintptr_t)tileset >> 4) * 31 + index) * 2654435761u;
+}
+
+// Pushes tables with `capacity` slots to the stack and moves the entries from the current ones.
+static void
+tilemap_dedupe_grow_(TileMapDedupe_ **found, TileMapUnique_ **unique, u32 capacity, u32 old_capacity)
+{
+    TileMapDedupe_ *f = bank_push_t(CORE->stack, TileMapDedupe_, capacity);
+    TileMapUnique_ *u = bank_push_t(CORE->stack, TileMapUnique_, capacity);
+    memset(f, 0, capacity * sizeof(TileMapDedupe_));
+    memset(u, 0, capacity * sizeof(TileMapUnique_));
+
+    u32 mask = capacity - 1;
+    u32 j;
+    for (u32 i = 0; i != old_capacity; ++i)
+    {
+        TileMapDedupe_ *old_f = *found + i;
+        if (old_f->tileset) {
+            for (j = tilemap_dedupe_key_(old_f->tileset, old_f->index) & mask; f[j].tileset; j = (j + 1) & mask) {
+            }
+            f[j] = *old_f;
+        }
+        TileMapUnique_ *old_u = *unique + i;
+        if (old_u->tileset) {
+            for (j = (u32)old_u->hash & mask; u[j].tileset; j = (j + 1) & mask) {
+            }
+            u[j] = *old_u;
+        }
+    }
+    *found = f;
+    *unique = u;
+}
+
+void
+tilemap_dedupe(TileMap *tilemap)
+{
+    BankState bank_state = bank_begin(CORE->stack);
+
+    i32 count = tilemap->width * tilemap->height;
+
+    // With the compact layout only the definitions are remapped.
+    u8 *it = (u8*)tilemap->tiles;
+    size_t stride = sizeof(Tile);
+    if (!tilemap->tiles) {
+        it = (u8*)(tilemap->defs + 1);
+        stride = sizeof(TileDef);
+        count = tilemap->defs_count - 1;
+    }
+
+    // Tiles found in the map (by tileset and index) and unique tiles (by content).
+    // Sized by the number of distinct tiles, doubled when half of the slots are used.
+    TileMapDedupe_ *found = 0;
+    TileMapUnique_ *unique = 0;
+    u32 capacity = 256;
+    u32 found_count = 0;
+    tilemap_dedupe_grow_(&found, &unique, capacity, 0);
+    u32 mask = capacity - 1;
+
+    for (i32 i = 0; i != count; ++i, it += stride)
+    {
+        TileDef *tile = (TileDef*)it;
+        if (!tile->tileset || tile->tileset->format != BitmapFormat_8) {
+            continue;
+        }
+
+        u32 key = tilemap_dedupe_key_(tile->tileset, tile->index);
+        TileMapDedupe_ *f;
+        for (u32 j = key & mask;; j = (j + 1) & mask) {
+            f = found + j;
+            if (!f->tileset || (f->tileset == tile->tileset && f->index == tile->index)) {
+                break;
+            }
+        }
+
+        if (!f->tileset && (found_count + 1) * 2 > capacity)
+        {
+            tilemap_dedupe_grow_(&found, &unique, capacity * 2, capacity);
+            capacity *= 2;
+            mask = capacity - 1;
+            for (u32 j = key & mask;; j = (j + 1) & mask) {
+                f = found + j;
+                if (!f->tileset) {
+                    break;
+                }
+            }
+        }
+
+        if (!f->tileset)
+        {
+            ++found_count;
+            f->tileset = tile->tileset;
+            f->index = tile->index;
+
+            Rect r = tile_get(tile->tileset, tile->index);
+            u64 hash = 14695981039346656037ull;
+            u8 *row = tile->tileset->pixels + r.min_x + r.min_y * tile->tileset->width;
+            for (i32 y = r.min_y; y != r.max_y; ++y, row += tile->tileset->width) {
+                hash = hash_bytes_(hash, row, rect_width(&r));
+            }
+
+            TileMapUnique_ *u;
+            for (u32 j = (u32)hash & mask;; j = (j + 1) & mask) {
+                u = unique + j;
+                if (!u->tileset
+                    || (u->hash == hash && tilemap_tiles_equal_(u->tileset, u->index, tile->tileset, tile->index))) {
+                    break;
+                }
+            }
+            if (!u->tileset) {
+                u->hash = hash;
+                u->tileset = tile->tileset;
+                u->index = tile->index;
+            }
+            f->unique_tileset = u->tileset;
+            f->unique_index = u->index;
+        }
+
+        tile->tileset = f->unique_tileset;
+        tile->index = f->unique_index;
+    }
+
+    bank_end(&bank_state);
+}
+
+enum
+{
+    TileMapDraw_All      = 0,
+    TileMapDraw_Static   = 1,
+    TileMapDraw_Animated = 2,
+};
+
+static inline b32
+tile_is_animated_(Bitmap *tileset, i32 index)
+{
+    TileAnimations *animations = tileset->animations;
+    return animations &&
+        index >= 0 && index < animations->tiles_count &&
+        animations->lookup[index] != -1;
+}
+
+// Draws `r` range of tiles, `mode` selects which tiles are drawn.
+// Returns number of animated tiles in the range.
+static i32
+tilemap_draw_range_(TileMap *tilemap, Rect r, i32 mode)
+{
+    i32 y, x;
+    i32 animated = 0;
+    Bitmap *tileset;
+    i32 index;
+    for (y = r.min_y; y != r.max_y; ++y) {
+        for (x = r.min_x; x != r.max_x; ++x) {
+            if (tilemap->tiles) {
+                Tile *tile = tilemap->tiles + x + y * tilemap->width;
+                tileset = tile->tileset;
+                index = tile->index;
+            } else {
+                u16 id = tilemap->ids[x + y * tilemap->width];
+                tileset = id ? tilemap->defs[id].tileset : 0;
+                index = id ? tilemap->defs[id].index : 0;
+            }
+            if (!tileset) {
+                continue;
+            }
+            if (mode != TileMapDraw_All) {
+                b32 is_animated = tile_is_animated_(tileset, index);
+                animated += is_animated;
+                if (is_animated != (mode == TileMapDraw_Animated)) {
+                    continue;
+                }
+            }
+            tile_draw(tileset, index,
+                x * tilemap->tile_width,
+                y * tilemap->tile_height);
+        }
+    }
+    return animated;
+}
+
+void
+tilemap_draw(TileMap *tilemap)
+{
+    Rect r;
+    if (tilemap_get_draw_range(tilemap, &r)) {
+        tilemap_draw_range_(tilemap, r, TileMapDraw_All);
+    }
+}
+
+#if defined(_MSC_VER) && defined(_M_X64)
+static inline i32 bit_first_(u64 bits) { unsigned long i; _BitScanForward64(&i, bits); return (i32)i; }
+static inline i32 bit_last_(u64 bits)  { unsigned long i; _BitScanReverse64(&i, bits); return (i32)i; }
+#elif defined(_MSC_VER)
+static inline i32 bit_first_(u64 bits) {
+    unsigned long i;
+    if (_BitScanForward(&i, (u32)bits)) return (i32)i;
+    _BitScanForward(&i, (u32)(bits >> 32));
+    return (i32)i + 32;
+}
+static inline i32 bit_last_(u64 bits) {
+    unsigned long i;
+    if (_BitScanReverse(&i, (u32)(bits >> 32))) return (i32)i + 32;
+    _BitScanReverse(&i, (u32)bits);
+    return (i32)i;
+}
+#else
+static inline i32 bit_first_(u64 bits) { return __builtin_ctzll(bits); }
+static inline i32 bit_last_(u64 bits)  { return 63 - __builtin_clzll(bits); }
+#endif
+
+static void
+tilemap_solid_set_(TileMap *tilemap, i32 x, i32 y, i32 flags)
+{
+    i32 row_words = ceil_div(tilemap->width, 64);
+    i32 column_words = ceil_div(tilemap->height, 64);
+    for (i32 e = 0; e != 4; ++e) {
+        // Edge_Left and Edge_Right by rows, Edge_Top and Edge_Bottom by columns.
+        u64 *word = (e & 1)
+            ? tilemap->solid[e] + x * column_words + (y >> 6)
+            : tilemap->solid[e] + y * row_words + (x >> 6);
+        u64 bit = 1ull << (((e & 1) ? y : x) & 63);
+        if (flags & (1 << e)) {
+            *word |= bit;
+        } else {
+            *word &= ~bit;
+        }
+    }
+}
+
+void
+tilemap_solid_build(TileMap *tilemap)
+{
+    i32 rows_size = ceil_div(tilemap->width, 64) * tilemap->height;
+    i32 columns_size = ceil_div(tilemap->height, 64) * tilemap->width;
+    if (!tilemap->solid[0]) {
+        for (i32 e = 0; e != 4; ++e) {
+            tilemap->solid[e] = bank_push_t(CORE->storage, u64, (e & 1) ? columns_size : rows_size);
+        }
+    }
+    for (i32 e = 0; e != 4; ++e) {
+        memset(tilemap->solid[e], 0, ((e & 1) ? columns_size : rows_size) * sizeof(u64));
+    }
+
+    i32 i = 0;
+    for (i32 y = 0; y != tilemap->height; ++y) {
+        for (i32 x = 0; x != tilemap->width; ++x, ++i) {
+            i32 flags = tilemap->tiles ? tilemap->tiles[i].flags : tilemap->edges[i];
+            if (flags & Edge_All) {
+                tilemap_solid_set_(tilemap, x, y, flags);
+            }
+        }
+    }
+}
+
+i32
+tilemap_solid_find(TileMap *tilemap, i32 edge, i32 line, i32 from, i32 to, i32 mask)
+{
+    ASSERT(tilemap->solid[0]);
+    i32 e = bit_first_((u64)edge);
+    ASSERT(edge == (1 << e) && e < 4);
+    bool rows = (e & 1) == 0;
+    i32 count = rows ? tilemap->width : tilemap->height;
+    if (line < 0 || line >= (rows ? tilemap->height : tilemap->width)) {
+        return -1;
+    }
+    u64 *words = tilemap->solid[e] + line * ceil_div(count, 64);
+    // Index of the tile is `line * stride + i * step`.
+    i32 stride = rows ? tilemap->width : 1;
+    i32 step = rows ? 1 : tilemap->width;
+
+    i32 i, w;
+    u64 bits;
+    if (from < to)
+    {
+        from = maximum(from, 0);
+        to = minimum(to, count);
+        while (from < to) {
+            w = from >> 6;
+            bits = words[w] & (~0ull << (from & 63));
+            if (to < (w + 1) << 6) {
+                bits &= ~0ull >> (64 - (to & 63));
+            }
+            while (bits) {
+                i = (w << 6) + bit_first_(bits);
+                i32 t = line * stride + i * step;
+                if (mask & (tilemap->tiles ? tilemap->tiles[t].layer : tilemap->layers[t])) {
+                    return i;
+                }
+                bits &= bits - 1;
+            }
+            from = (w + 1) << 6;
+        }
+    }
+    else
+    {
+        from = minimum(from, count - 1);
+        to = maximum(to, -1);
+        while (from > to) {
+            w = from >> 6;
+            bits = words[w] & (~0ull >> (63 - (from & 63)));
+            if (to + 1 > (w << 6)) {
+                bits &= ~0ull << ((to + 1) & 63);
+            }
+            while (bits) {
+                i32 b = bit_last_(bits);
+                i = (w << 6) + b;
+                i32 t = line * stride + i * step;
+                if (mask & (tilemap->tiles ? tilemap->tiles[t].layer : tilemap->layers[t])) {
+                    return i;
+                }
+                bits &= ~(1ull << b);
+            }
+            from = (w << 6) - 1;
+        }
+    }
+    return -1;
+}
+
+// Returns true if the tile covers the whole tilemap cell with non-transparent pixels.
+// Animated tiles are never opaque, as their frames might not be.
+static bool
+tile_opaque_(TileMap *tilemap, Bitmap *tileset, i32 index)
+{
+    if (!tileset || tileset->format != BitmapFormat_8 || tile_is_animated_(tileset, index) ||
+        tileset->tile_width < tilemap->tile_width || tileset->tile_height < tilemap->tile_height) {
+        return false;
+    }
+    Rect r = tile_get(tileset, index);
+    u8 *row = tileset->pixels + r.min_x + r.min_y * tileset->width;
+    for (i32 y = 0; y != tilemap->tile_height; ++y, row += tileset->width) {
+        for (i32 x = 0; x != tilemap->tile_width; ++x) {
+            if (row[x] == 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void
+tilemap_tile_set(TileMap *tilemap, i32 x, i32 y, Tile *tile)
+{
+    ASSERT(x >= 0 && x < tilemap->width && y >= 0 && y < tilemap->height);
+    i32 i = x + y * tilemap->width;
+    if (tilemap->tiles) {
+        tilemap->tiles[i] = *tile;
+    } else {
+        tilemap->ids[i] = tilemap_def_acquire(tilemap, tile->tileset, tile->index);
+        tilemap->edges[i] = (u8)tile->flags;
+        tilemap->layers[i] = (u8)tile->layer;
+    }
+    if (tilemap->solid[0]) {
+        tilemap_solid_set_(tilemap, x, y, tile->flags);
+    }
+    if (tilemap->opaque) {
+        u64 bit = 1ull << (x & 63);
+        u64 *word = tilemap->opaque + y * ceil_div(tilemap->width, 64) + (x >> 6);
+        *word = tile_opaque_(tilemap, tile->tileset, tile->index) ? (*word | bit) : (*word & ~bit);
+    }
+    if (tilemap->cache) {
+        tilemapcache_invalidate(tilemap->cache, rect_make_size(x, y, 1, 1));
+    }
+}
+
+Tile
+tilemap_tile_get(TileMap *tilemap, i32 x, i32 y)
+{
+    ASSERT(x >= 0 && x < tilemap->width && y >= 0 && y < tilemap->height);
+    i32 i = x + y * tilemap->width;
+    if (tilemap->tiles) {
+        return tilemap->tiles[i];
+    }
+    Tile tile;
+    memset(&tile, 0, sizeof(Tile));
+    tile.tileset = tilemap->defs[tilemap->ids[i]].tileset;
+    tile.index = tilemap->defs[tilemap->ids[i]].index;
+    tile.flags = tilemap->edges[i];
+    tile.layer = tilemap->layers[i];
+    return tile;
+}
+
+//
+// Tilemap cache
+//
+
+void
+tilemapcache_init(TileMapCache *cache, TileMap *tilemap)
+{
+    memset(cache, 0, sizeof(TileMapCache));
+    cache->tilemap = tilemap;
+    cache->width  = ceil_div(tilemap->width,  PUN_TILEMAP_CHUNK_TILES);
+    cache->height = ceil_div(tilemap->height, PUN_TILEMAP_CHUNK_TILES);
+
+    i32 count = cache->width * cache->height;
+    cache->slots = bank_push_t(CORE->storage, i16, count);
+    memset(cache->slots, 0xFF, count * sizeof(i16));
+
+    cache->chunks_count = minimum(count, PUN_TILEMAP_CHUNKS_MAX);
+    for (i32 i = 0; i != cache->chunks_count; ++i) {
+        bitmap_init(&cache->chunks[i],
+            PUN_TILEMAP_CHUNK_TILES * tilemap->tile_width,
+            PUN_TILEMAP_CHUNK_TILES * tilemap->tile_height,
+            0, 0, 0);
+        cache->chunks_index[i] = -1;
+    }
+    cache->animations_version = tile_animations_version_;
+
+    tilemap->cache = cache;
+}
+
+void
+tilemapcache_invalidate(TileMapCache *cache, Rect range)
+{
+    i32 min_x = maximum(0, range.min_x / PUN_TILEMAP_CHUNK_TILES);
+    i32 min_y = maximum(0, range.min_y / PUN_TILEMAP_CHUNK_TILES);
+    i32 max_x = minimum(cache->width,  ceil_div(range.max_x, PUN_TILEMAP_CHUNK_TILES));
+    i32 max_y = minimum(cache->height, ceil_div(range.max_y, PUN_TILEMAP_CHUNK_TILES));
+    for (i32 y = min_y; y < max_y; ++y) {
+        for (i32 x = min_x; x < max_x; ++x) {
+            i16 *slot = cache->slots + x + y * cache->width;
+            if (*slot != -1) {
+                cache->chunks_index[*slot] = -1;
+                *slot = -1;
+            }
+        }
+    }
+}
+
+// Returns a bitmap for the chunk, -1 if all bitmaps are used by this draw.
+static i32
+tilemapcache_acquire_(TileMapCache *cache, i32 chunk)
+{
+    i32 slot = -1;
+    u32 age = 0;
+    for (i32 i = 0; i != cache->chunks_count; ++i) {
+        if (cache->chunks_index[i] == -1) {
+            slot = i;
+            break;
+        }
+        if (cache->draws - cache->chunks_used[i] > age) {
+            age = cache->draws - cache->chunks_used[i];
+            slot = i;
+        }
+    }
+    if (slot != -1) {
+        if (cache->chunks_index[slot] != -1) {
+            cache->slots[cache->chunks_index[slot]] = -1;
+        }
+        cache->chunks_index[slot] = chunk;
+        cache->slots[chunk] = (i16)slot;
+    }
+    return slot;
+}
+
+void
+tilemapcache_draw(TileMapCache *cache)
+{
+    TileMap *tilemap = cache->tilemap;
+    Rect r;
+    if (!tilemap_get_draw_range(tilemap, &r)) {
+        return;
+    }
+
+    cache->draws++;
+
+    // Tiles that got animated since are still drawn into the chunks.
+    if (cache->animations_version != tile_animations_version_) {
+        cache->animations_version = tile_animations_version_;
+        tilemapcache_invalidate(cache, rect_make_size(0, 0, tilemap->width, tilemap->height));
+    }
+
+    i32 chunk_width  = PUN_TILEMAP_CHUNK_TILES * tilemap->tile_width;
+    i32 chunk_height = PUN_TILEMAP_CHUNK_TILES * tilemap->tile_height;
+    i32 max_x = ceil_div(r.max_x, PUN_TILEMAP_CHUNK_TILES);
+    i32 max_y = ceil_div(r.max_y, PUN_TILEMAP_CHUNK_TILES);
+    for (i32 cy = r.min_y / PUN_TILEMAP_CHUNK_TILES; cy < max_y; ++cy)
+    {
+        for (i32 cx = r.min_x / PUN_TILEMAP_CHUNK_TILES; cx < max_x; ++cx)
+        {
+            Rect tiles = rect_make_size(cx * PUN_TILEMAP_CHUNK_TILES, cy * PUN_TILEMAP_CHUNK_TILES,
+                PUN_TILEMAP_CHUNK_TILES, PUN_TILEMAP_CHUNK_TILES);
+            tiles.max_x = minimum(tiles.max_x, tilemap->width);
+            tiles.max_y = minimum(tiles.max_y, tilemap->height);
+
+            i32 chunk = cx + cy * cache->width;
+            i32 slot = cache->slots[chunk];
+            if (slot == -1)
+            {
+                slot = tilemapcache_acquire_(cache, chunk);
+                if (slot == -1) {
+                    // More chunks visible than there are bitmaps, draw the tiles directly.
+                    tiles = rect_clip(tiles, r);
+                    tilemap_draw_range_(tilemap, tiles, TileMapDraw_All);
+                    continue;
+                }
+                Bitmap *bitmap = &cache->chunks[slot];
+                canvas_push(bitmap);
+                bitmap_clear(bitmap, 0);
+                CORE->canvas.translate_x = -tiles.min_x * tilemap->tile_width;
+                CORE->canvas.translate_y = -tiles.min_y * tilemap->tile_height;
+                cache->chunks_animated[slot] = tilemap_draw_range_(tilemap, tiles, TileMapDraw_Static);
+                canvas_pop();
+            }
+            cache->chunks_used[slot] = cache->draws;
+
+            Rect rect = rect_make_size(0, 0,
+                rect_width(&tiles) * tilemap->tile_width,
+                rect_height(&tiles) * tilemap->tile_height);
+            bitmap_draw(&cache->chunks[slot], cx * chunk_width, cy * chunk_height, 0, 0, &rect);
+            if (cache->chunks_animated[slot]) {
+                tilemap_draw_range_(tilemap, rect_clip(tiles, r), TileMapDraw_Animated);
+            }
+        }
+    }
+}
+
+//
+// Tilemap layers
+//
+
+void
+tilemap_opaque_build(TileMap *tilemap)
+{
+    i32 row_words = ceil_div(tilemap->width, 64);
+    if (!tilemap->opaque) {
+        tilemap->opaque = bank_push_t(CORE->storage, u64, row_words * tilemap->height);
+    }
+    memset(tilemap->opaque, 0, row_words * tilemap->height * sizeof(u64));
+
+    // Remember recently checked tiles, maps usually use few distinct tiles.
+    struct { Bitmap *tileset; i32 index; b32 opaque; } seen[256];
+    memset(seen, 0, sizeof(seen));
+
+    i32 i = 0;
+    for (i32 y = 0; y != tilemap->height; ++y) {
+        for (i32 x = 0; x != tilemap->width; ++x, ++i) {
+            Bitmap *tileset;
+            i32 index;
+            if (tilemap->tiles) {
+                tileset = tilemap->tiles[i].tileset;
+                index = tilemap->tiles[i].index;
+            } else {
+                tileset = tilemap->defs[tilemap->ids[i]].tileset;
+                index = tilemap->defs[tilemap->ids[i]].index;
+            }
+            if (!tileset) {
+                continue;
+            }
+            u32 key = ((u32)((uintptr_t)tileset >> 4) * 31 + (u32)index) & 255;
+            if (seen[key].tileset != tileset || seen[key].index != index) {
+                seen[key].tileset = tileset;
+                seen[key].index = index;
+                seen[key].opaque = tile_opaque_(tilemap, tileset, index);
+            }
+            if (seen[key].opaque) {
+                tilemap->opaque[y * row_words + (x >> 6)] |= 1ull << (x & 63);
+            }
+        }
+    }
+}
+
+// Returns true if all tiles in the `range` are opaque.
+static bool
+tilemap_opaque_range_(TileMap *tilemap, Rect range)
+{
+    i32 row_words = ceil_div(tilemap->width, 64);
+    i32 w_min = range.min_x >> 6;
+    i32 w_max = (range.max_x - 1) >> 6;
+    u64 mask_min = ~0ull << (range.min_x & 63);
+    u64 mask_max = ~0ull >> (63 - ((range.max_x - 1) & 63));
+    for (i32 y = range.min_y; y != range.max_y; ++y) {
+        u64 *words = tilemap->opaque + y * row_words;
+        for (i32 w = w_min; w <= w_max; ++w) {
+            u64 mask = ~0ull;
+            if (w == w_min) mask &= mask_min;
+            if (w == w_max) mask &= mask_max;
+            if ((words[w] & mask) != mask) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+typedef struct
+{
+    TileMap *tilemap;
+    TileMapCache *cache;
+    Rect range;
+    b32 visible;
+}
+TileMapLayerItem_;
+
+static DRAWLIST_CALLBACK(tilemap_layer_draw_)
+{
+    TileMapLayerItem_ *item = (TileMapLayerItem_*)data;
+    if (item->cache) {
+        tilemapcache_draw(item->cache);
+    } else {
+        tilemap_draw_range_(item->tilemap, item->range, TileMapDraw_All);
+    }
+}
+
+// Finds the visible range of the `layer` with the canvas translated by its scroll factors.
+static void
+tilemap_layer_item_(TileMapLayer *layer, Canvas *canvas, TileMapLayerItem_ *item)
+{
+    CORE->canvas.translate_x = (i32)floorf(canvas->translate_x * layer->scroll_x) + layer->x;
+    CORE->canvas.translate_y = (i32)floorf(canvas->translate_y * layer->scroll_y) + layer->y;
+    item->tilemap = layer->tilemap;
+    item->cache = layer->cache;
+    item->visible = tilemap_get_draw_range(layer->tilemap, &item->range)
+        && item->range.min_x < item->range.max_x
+        && item->range.min_y < item->range.max_y;
+}
+
+void
+tilemap_layers_draw_push(TileMapLayer *layers, i32 count)
+{
+    Canvas canvas = CORE->canvas;
+    TileMapLayerItem_ item;
+
+    // Find the front-most layer covering the clip.
+    i32 covered_z = INT32_MIN;
+    TileMapLayer *layer = layers;
+    for (i32 i = 0; i != count; ++i, ++layer)
+    {
+        TileMap *tilemap = layer->tilemap;
+        if (!tilemap->opaque || layer->z <= covered_z) {
+            continue;
+        }
+        tilemap_layer_item_(layer, &canvas, &item);
+        if (item.visible)
+        {
+            // The tilemap has to cover the whole clip, not only the visible part.
+            Rect view = canvas.clip;
+            rect_tr(&view, -CORE->canvas.translate_x, -CORE->canvas.translate_y);
+            if (view.min_x >= 0 && view.min_y >= 0 &&
+                view.max_x <= tilemap->width  * tilemap->tile_width &&
+                view.max_y <= tilemap->height * tilemap->tile_height &&
+                tilemap_opaque_range_(tilemap, item.range)) {
+                covered_z = layer->z;
+            }
+        }
+    }
+
+    // The items are copied to the draw list, ranges are found again as that's cheap.
+    layer = layers;
+    for (i32 i = 0; i != count; ++i, ++layer) {
+        if (layer->z < covered_z) {
+            continue;
+        }
+        tilemap_layer_item_(layer, &canvas, &item);
+        if (item.visible) {
+            drawlist_callback_push_blob(CORE->draw_list, tilemap_layer_draw_, &item, sizeof(item), layer->z);
+        }
+    }
+
+    CORE->canvas = canvas;
+}
+
+//
+// Scroll cache
+//
+
+void
+scrollcache_init(ScrollCache *cache, i32 width, i32 height)
+{
+    memset(cache, 0, sizeof(ScrollCache));
+    bitmap_init(&cache->bitmap, width, height, 0, 0, 0);
+}
+
+void
+scrollcache_invalidate(ScrollCache *cache)
+{
+    cache->valid = false;
+}
+
+static void
+scrollcache_redraw_(ScrollCache *cache, Rect rect, ScrollCacheCallbackF *callback, void *user)
+{
+    if (rect.max_x > rect.min_x && rect.max_y > rect.min_y) {
+        i32 translate_x = CORE->canvas.translate_x;
+        i32 translate_y = CORE->canvas.translate_y;
+        canvas_push(&cache->bitmap);
+        CORE->canvas.translate_x = translate_x;
+        CORE->canvas.translate_y = translate_y;
+        clip_set(rect);
+        callback(user);
+        canvas_pop();
+    }
+}
+
+void
+scrollcache_draw(ScrollCache *cache, ScrollCacheCallbackF *callback, void *user)
+{
+    Bitmap *canvas = CORE->canvas.bitmap;
+    Bitmap *bitmap = &cache->bitmap;
+    ASSERT(bitmap->width == canvas->width && bitmap->height == canvas->height);
+
+    i32 w = bitmap->width;
+    i32 h = bitmap->height;
+    i32 dx = CORE->canvas.translate_x - cache->translate_x;
+    i32 dy = CORE->canvas.translate_y - cache->translate_y;
+
+    if (!cache->valid || abs(dx) >= w || abs(dy) >= h)
+    {
+        scrollcache_redraw_(cache, rect_make_size(0, 0, w, h), callback, user);
+    }
+    else if (dx != 0 || dy != 0)
+    {
+        // Shift the rows in place, iterating in the direction that
+        // doesn't overwrite the rows we haven't moved yet.
+        i32 row_size = w - abs(dx);
+        i32 dst_x = maximum(0,  dx);
+        i32 src_x = maximum(0, -dx);
+        i32 y, y_end, y_step;
+        if (dy > 0) {
+            y = h - 1; y_end = dy - 1; y_step = -1;
+        } else {
+            y = 0; y_end = h + dy; y_step = 1;
+        }
+        for (; y != y_end; y += y_step) {
+            memmove(bitmap->pixels + (y * w) + dst_x,
+                    bitmap->pixels + ((y - dy) * w) + src_x,
+                    row_size);
+        }
+
+        // Redraw exposed strips, rows first and then columns for the rest.
+        Rect rows = dy > 0
+            ? rect_make(0, 0, w, dy)
+            : rect_make(0, h + dy, w, h);
+        Rect columns = dx > 0
+            ? rect_make(0, 0, dx, h)
+            : rect_make(w + dx, 0, w, h);
+        if (dy > 0) {
+            columns.min_y = dy;
+        } else {
+            columns.max_y = h + dy;
+        }
+        scrollcache_redraw_(cache, rows, callback, user);
+        scrollcache_redraw_(cache, columns, callback, user);
+    }
+
+    cache->translate_x = CORE->canvas.translate_x;
+    cache->translate_y = CORE->canvas.translate_y;
+    cache->valid = true;
+
+    Rect clip = CORE->canvas.clip;
+    u8 *src = bitmap->pixels + clip.min_x + (clip.min_y * w);
+    u8 *dst = canvas->pixels + clip.min_x + (clip.min_y * w);
+    for (i32 y = clip.min_y; y < clip.max_y; ++y, src += w, dst += w) {
+        memcpy(dst, src, clip.max_x - clip.min_x);
+    }
 }
 
-void
-tilemap_draw(TileMap *tilemap)
+typedef struct
 {
-    Rect r;
-    if (tilemap_get_draw_range(tilemap, &r))
-    {
-        i32 y, x;
-        Tile *tile = tilemap->tiles + (r.min_y * tilemap->width);
-        for (y = r.min_y; y != r.max_y; ++y) {
-            for (x = r.min_x; x != r.max_x; ++x) {
-                if (tile[x].tileset) {
-                    tile_draw(tile[x].tileset, tile[x].index,
-                        x * tilemap->tile_width,
-                        y * tilemap->tile_height);
-                }
-            }
-            tile += tilemap->width;
-        }
+    TileMap *tilemap;
+    u8 background;
+}
+ScrollCacheTileMap_;
+
+static SCROLLCACHE_CALLBACK(scrollcache_tilemap_callback_)
+{
+    ScrollCacheTileMap_ *data = (ScrollCacheTileMap_*)user;
+    Rect clip = CORE->canvas.clip;
+    Bitmap *bitmap = CORE->canvas.bitmap;
+    u8 *row = bitmap->pixels + clip.min_x + (clip.min_y * bitmap->width);
+    for (i32 y = clip.min_y; y != clip.max_y; ++y, row += bitmap->width) {
+        memset(row, data->background, clip.max_x - clip.min_x);
     }
+    tilemap_draw(data->tilemap);
+}
+
+void
+scrollcache_draw_tilemap(ScrollCache *cache, TileMap *tilemap, u8 background)
+{
+    ScrollCacheTileMap_ data = { tilemap, background };
+    scrollcache_draw(cache, scrollcache_tilemap_callback_, &data);
 }
 
 //
@@ -3766,16 +7956,21 @@ tilemap_draw(TileMap *tilemap)
 #if PUNITY_USE_STB_VORBIS
 
 static void
-sound_load_stbv_(Sound *sound, stb_vorbis *stream)
+sound_info_stbv_(Sound *sound, stb_vorbis *stream)
 {
     stb_vorbis_info info = stb_vorbis_get_info(stream);
     sound->volume = PUNP_SOUND_DEFAULT_SOUND_VOLUME;
     sound->rate = info.sample_rate;
     sound->channels = info.channels;
     sound->samples_count = stb_vorbis_stream_length_in_samples(stream);
-    sound->samples = bank_push(CORE->storage, PUNP_SOUND_SAMPLES_TO_BYTES(sound->samples_count, sound->channels));
+}
 
-    static i16 buffer[1024];
+// Decodes the `stream` to `sound->samples` and closes it.
+// Doesn't touch any shared state, so it can be used from worker threads.
+static void
+sound_decode_stbv_(Sound *sound, stb_vorbis *stream)
+{
+    i16 buffer[1024];
     i16 *it = sound->samples;
     int samples_read_per_channel;
     for (;;) {
@@ -3794,6 +7989,14 @@ sound_load_stbv_(Sound *sound, stb_vorbis *stream)
     stb_vorbis_close(stream);
 }
 
+static void
+sound_load_stbv_(Sound *sound, stb_vorbis *stream)
+{
+    sound_info_stbv_(sound, stream);
+    sound->samples = bank_push(CORE->storage, PUNP_SOUND_SAMPLES_TO_BYTES(sound->samples_count, sound->channels));
+    sound_decode_stbv_(sound, stream);
+}
+
 void
 sound_load(Sound *sound, const char *path)
 {
@@ -3835,6 +8038,447 @@ sound_load_resource(Sound *sound, const char *resource_name)
 
 #endif // PUNITY_USE_STB_VORBIS
 
+//
+// Packs
+//
+
+u32
+pack_hash(const char *name)
+{
+    u32 hash = 2166136261u;
+    for (const u8 *it = (const u8*)name; *it; ++it) {
+        hash ^= *it;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Checks that everything the pack points to is inside of it,
+// so the rest of the pack functions don't have to.
+static bool
+pack_check_(u8 *data, size_t size)
+{
+    PackHeader *header = (PackHeader*)data;
+    if (size < sizeof(PackHeader)
+        || header->magic != PUN_PACK_MAGIC
+        || header->version != PUN_PACK_VERSION
+        || header->size != size
+        || (header->entries_offset & 3) || (header->index_offset & 3) || (header->palette_offset & 3)
+        || header->entries_offset + (u64)header->entries_count * sizeof(PackEntry) > size
+        || header->index_offset + (u64)header->index_count * sizeof(u32) > size
+        || header->index_count == 0
+        || (header->index_count & (header->index_count - 1)) != 0)
+    {
+        return false;
+    }
+
+    u32 *index = (u32*)(data + header->index_offset);
+    for (u32 i = 0; i != header->index_count; ++i) {
+        if (index[i] > header->entries_count) {
+            return false;
+        }
+    }
+
+    PackEntry *entry = (PackEntry*)(data + header->entries_offset);
+    for (u32 i = 0; i != header->entries_count; ++i, ++entry) {
+        if (entry->name_offset >= size
+            || !memchr(data + entry->name_offset, 0, size - entry->name_offset)
+            || (u64)entry->data_offset + entry->data_size > size) {
+            return false;
+        }
+        if (entry->type == PackEntry_Bitmap
+            && (entry->bitmap.width < 0 || entry->bitmap.height < 0
+                || entry->bitmap.pitch < entry->bitmap.width
+                || (u64)entry->bitmap.pitch * entry->bitmap.height > entry->data_size)) {
+            return false;
+        }
+        if (entry->type == PackEntry_Sound
+            && (entry->sound.channels < 1 || entry->sound.channels > 2
+                || (u64)entry->sound.samples_count * entry->sound.channels * sizeof(i16) > entry->data_size)) {
+            return false;
+        }
+    }
+
+    if (header->palette_offset) {
+        if (header->palette_offset + (u64)sizeof(PackPalette) > size) {
+            return false;
+        }
+        PackPalette *palette = (PackPalette*)(data + header->palette_offset);
+        if (palette->ranges_count < 0
+            || header->palette_offset + sizeof(PackPalette) + (u64)palette->ranges_count * sizeof(PackPaletteRange) > size) {
+            return false;
+        }
+        PackPaletteRange *range = (PackPaletteRange*)(palette + 1);
+        for (i32 i = 0; i != palette->ranges_count; ++i, ++range) {
+            if (range->begin < 0 || range->begin > range->it || range->it > range->end || range->end > 256) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+pack_init_(Pack *pack, void *data, size_t size)
+{
+    if (!pack_check_((u8*)data, size)) {
+        printf("Invalid pack.\n");
+        return false;
+    }
+
+    PackHeader *header = (PackHeader*)data;
+    pack->data = (u8*)data;
+    pack->size = size;
+    pack->header = header;
+    pack->entries = (PackEntry*)(pack->data + header->entries_offset);
+    pack->index = (u32*)(pack->data + header->index_offset);
+    return true;
+}
+
+bool
+pack_open_memory(Pack *pack, void *data, size_t size)
+{
+    memset(pack, 0, sizeof(Pack));
+    return pack_init_(pack, data, size);
+}
+
+bool
+pack_open(Pack *pack, const char *path)
+{
+    memset(pack, 0, sizeof(Pack));
+    void *data = 0;
+    size_t size = 0;
+
+#if PUN_PLATFORM_WINDOWS
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("Unable to open pack %s\n", path);
+        return false;
+    }
+    size = GetFileSize(file, 0);
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+    if (mapping) {
+        data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    }
+    if (!data) {
+        printf("Unable to map pack %s\n", path);
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        return false;
+    }
+    pack->file_ = file;
+    pack->mapping_ = mapping;
+#else
+    int file = open(path, O_RDONLY);
+    if (file == -1) {
+        printf("Unable to open pack %s\n", path);
+        return false;
+    }
+    struct stat info;
+    if (fstat(file, &info) == 0) {
+        size = (size_t)info.st_size;
+        data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    if (!data || data == MAP_FAILED) {
+        printf("Unable to map pack %s\n", path);
+        return false;
+    }
+    // Only used to tell that the pack has to be unmapped.
+    pack->mapping_ = data;
+#endif
+
+    if (!pack_init_(pack, data, size)) {
+        pack->data = (u8*)data;
+        pack->size = size;
+        pack_close(pack);
+        return false;
+    }
+    return true;
+}
+
+void
+pack_close(Pack *pack)
+{
+    if (pack->mapping_) {
+#if PUN_PLATFORM_WINDOWS
+        UnmapViewOfFile(pack->data);
+        CloseHandle((HANDLE)pack->mapping_);
+        CloseHandle((HANDLE)pack->file_);
+#else
+        munmap(pack->data, pack->size);
+#endif
+    }
+    memset(pack, 0, sizeof(Pack));
+}
+
+PackEntry *
+pack_find(Pack *pack, const char *name)
+{
+    if (!pack->header) {
+        return 0;
+    }
+    u32 hash = pack_hash(name);
+    u32 mask = pack->header->index_count - 1;
+    u32 i = hash & mask;
+    for (u32 probes = 0; probes != pack->header->index_count; ++probes, i = (i + 1) & mask) {
+        u32 slot = pack->index[i];
+        if (slot == 0) {
+            return 0;
+        }
+        PackEntry *entry = pack->entries + (slot - 1);
+        if (entry->hash == hash && strcmp((char*)pack->data + entry->name_offset, name) == 0) {
+            return entry;
+        }
+    }
+    return 0;
+}
+
+void *
+pack_resource_get(Pack *pack, const char *name, size_t *size)
+{
+    PackEntry *entry = pack_find(pack, name);
+    if (size) {
+        *size = entry ? entry->data_size : 0;
+    }
+    if (!entry) {
+        return 0;
+    }
+    return pack->data + entry->data_offset;
+}
+
+bool
+pack_palette_load(Pack *pack, Palette *palette)
+{
+    if (!pack->header || !pack->header->palette_offset) {
+        return false;
+    }
+    PackPalette *source = (PackPalette*)(pack->data + pack->header->palette_offset);
+    PackPaletteRange *ranges = (PackPaletteRange*)(source + 1);
+    memcpy(palette->colors, source->colors, sizeof(palette->colors));
+    palette->ranges_count = minimum(source->ranges_count, PUN_PALETTE_RANGES_COUNT);
+    // Ranges keep their versions, `palette_changed` bumps them so the cubes are rebuilt.
+    for (int i = 0; i != palette->ranges_count; ++i) {
+        palette->ranges[i].begin = ranges[i].begin;
+        palette->ranges[i].end = ranges[i].end;
+        palette->ranges[i].it = ranges[i].it;
+    }
+    palette_changed(palette);
+    return true;
+}
+
+bool
+pack_bitmap_load(Pack *pack, Bitmap *bitmap, const char *name)
+{
+    PackEntry *entry = pack_find(pack, name);
+    if (!entry || entry->type != PackEntry_Bitmap) {
+        return false;
+    }
+    memset(bitmap, 0, sizeof(Bitmap));
+    bitmap->width         = entry->bitmap.width;
+    bitmap->height        = entry->bitmap.height;
+    bitmap->pitch         = entry->bitmap.pitch;
+    bitmap->palette_range = entry->bitmap.palette_range;
+    bitmap->tile_width    = entry->bitmap.tile_width;
+    bitmap->tile_height   = entry->bitmap.tile_height;
+    bitmap->pixels        = pack->data + entry->data_offset;
+    return true;
+}
+
+bool
+pack_sound_load(Pack *pack, Sound *sound, const char *name)
+{
+    PackEntry *entry = pack_find(pack, name);
+    if (!entry) {
+        return false;
+    }
+    memset(sound, 0, sizeof(Sound));
+    if (entry->type == PackEntry_Sound) {
+        sound->volume = PUNP_SOUND_DEFAULT_SOUND_VOLUME;
+        sound->channels = entry->sound.channels;
+        sound->rate = entry->sound.rate;
+        sound->samples_count = entry->sound.samples_count;
+        sound->samples = (i16*)(pack->data + entry->data_offset);
+    }
+#if PUNITY_USE_STB_VORBIS
+    else if (entry->type == PackEntry_Raw) {
+        int error = 0;
+        stb_vorbis *stream = stb_vorbis_open_memory(pack->data + entry->data_offset, entry->data_size, &error, 0);
+        if (error || !stream) {
+            return false;
+        }
+        sound_load_stbv_(sound, stream);
+    }
+#endif
+    else {
+        return false;
+    }
+    sound->name = (char*)pack->data + entry->name_offset;
+    return true;
+}
+
+//
+// Loader
+//
+
+#if PUNITY_USE_STB_IMAGE && PUNITY_USE_STB_VORBIS
+
+void
+loader_begin(Loader *loader)
+{
+    loader->jobs_count = 0;
+    loader->committed = 0;
+    loader->banks_count = 0;
+    loader->started = false;
+}
+
+static LoaderJob *
+loader_push_(Loader *loader, int type, const char *resource_name)
+{
+    ASSERT_MESSAGE(loader->jobs_count != PUN_LOADER_JOBS_MAX, "Too many jobs, increase PUN_LOADER_JOBS_MAX.");
+    ASSERT_MESSAGE(!loader->started, "Jobs have to be added before loader_start.");
+    LoaderJob *job = loader->jobs + loader->jobs_count++;
+    memset(job, 0, sizeof(LoaderJob));
+    job->type = type;
+    job->name = resource_name;
+    // Resources are looked up here, as `resource_get` isn't thread-safe.
+    job->resource = resource_get(resource_name, &job->resource_size);
+    ASSERT(job->resource);
+    return job;
+}
+
+void
+loader_bitmap(Loader *loader, Bitmap *bitmap, const char *resource_name, int palette_range)
+{
+    LoaderJob *job = loader_push_(loader, LoaderJob_Bitmap, resource_name);
+    job->bitmap = bitmap;
+    job->palette_range = palette_range;
+}
+
+void
+loader_font(Loader *loader, Bitmap *font, const char *resource_name, i32 tile_width, i32 tile_height)
+{
+    LoaderJob *job = loader_push_(loader, LoaderJob_Font, resource_name);
+    job->bitmap = font;
+    job->tile_width = tile_width;
+    job->tile_height = tile_height;
+}
+
+void
+loader_sound(Loader *loader, Sound *sound, const char *resource_name)
+{
+    LoaderJob *job = loader_push_(loader, LoaderJob_Sound, resource_name);
+    job->sound = sound;
+}
+
+// Decodes jobs [begin, end) after the committed ones.
+static
+PARALLEL_FOR_PROC(loader_decode_)
+{
+    Loader *loader = (Loader*)user;
+    Bank *bank = loader->banks + worker;
+    for (i32 i = begin; i != end; ++i) {
+        LoaderJob *job = loader->jobs + loader->committed + i;
+        if (job->type == LoaderJob_Sound) {
+            int error = 0;
+            stb_vorbis *stream = stb_vorbis_open_memory(job->resource, (int)job->resource_size, &error, 0);
+            if (!error && stream) {
+                sound_info_stbv_(&job->decoded_sound, stream);
+                job->decoded_sound.samples = bank_push(bank, PUNP_SOUND_SAMPLES_TO_BYTES(job->decoded_sound.samples_count, job->decoded_sound.channels));
+                sound_decode_stbv_(&job->decoded_sound, stream);
+                job->decoded = job->decoded_sound.samples;
+            }
+        } else {
+            int comp;
+            job->decoded = stbi_load_from_memory(job->resource, (int)job->resource_size, &job->width, &job->height, &comp, STBI_rgb_alpha);
+        }
+    }
+}
+
+static void
+loader_commit_(LoaderJob *job)
+{
+    ASSERT_MESSAGE(job->decoded, "Unable to decode %s.", job->name);
+    switch (job->type)
+    {
+        case LoaderJob_Bitmap:
+            bitmap_init_ex_(CORE->storage, job->bitmap, job->width, job->height, job->decoded, PUN_BITMAP_32, job->palette_range, job->name);
+            stbi_image_free(job->decoded);
+            break;
+        case LoaderJob_Font:
+            bitmap_init_ex_(CORE->storage, job->bitmap, job->width, job->height, job->decoded, PUN_BITMAP_MASK, 0, job->name);
+            job->bitmap->tile_width  = job->tile_width;
+            job->bitmap->tile_height = job->tile_height;
+            stbi_image_free(job->decoded);
+            break;
+        case LoaderJob_Sound: {
+            Sound *sound = job->sound;
+            *sound = job->decoded_sound;
+            size_t size = PUNP_SOUND_SAMPLES_TO_BYTES(sound->samples_count, sound->channels);
+            sound->samples = bank_push(CORE->storage, size);
+            memcpy(sound->samples, job->decoded, size);
+
+            size = strlen(job->name) + 1;
+            sound->name = bank_push(CORE->storage, size);
+            memcpy(sound->name, job->name, size);
+        } break;
+    }
+    job->decoded = 0;
+}
+
+// Decodes up to `count` jobs in parallel and copies them to storage.
+static void
+loader_batch_(Loader *loader, i32 count)
+{
+    ASSERT_MESSAGE(loader->started, "Jobs are decoded after loader_start.");
+    count = minimum(count, loader->jobs_count - loader->committed);
+    parallel_for(count, 1, loader_decode_, loader);
+    for (i32 i = 0; i != count; ++i) {
+        loader_commit_(loader->jobs + loader->committed++);
+    }
+    for (i32 i = 0; i != loader->banks_count; ++i) {
+        bank_clear(&loader->banks[i]);
+    }
+    if (loader->committed == loader->jobs_count) {
+        for (i32 i = 0; i != loader->banks_count; ++i) {
+            bank_free(&loader->banks[i]);
+        }
+        loader->banks_count = 0;
+    }
+}
+
+void
+loader_start(Loader *loader)
+{
+    loader->started = true;
+    loader->banks_count = cpu_count();
+    for (i32 i = 0; i != loader->banks_count; ++i) {
+        bank_init(&loader->banks[i], PUN_LOADER_BANK_CAPACITY);
+    }
+}
+
+f32
+loader_update(Loader *loader)
+{
+    loader_batch_(loader, cpu_count());
+    if (loader->committed == loader->jobs_count) {
+        return 1.0f;
+    }
+    return (f32)loader->committed / loader->jobs_count;
+}
+
+void
+loader_wait(Loader *loader)
+{
+    do {
+        loader_batch_(loader, cpu_count());
+    } while (loader->committed != loader->jobs_count);
+}
+
+#endif // PUNITY_USE_STB_IMAGE && PUNITY_USE_STB_VORBIS
+
 typedef struct PunPAudioSource
 {
     Sound *sound;
@@ -4157,6 +8801,24 @@ punity_frame_end()
 void record_frame_();
 #endif
 
+static void
+palette_snapshot_update_()
+{
+    const PaletteSnapshot *current = CORE->palette_snapshot;
+    Color *colors = CORE->palette_fx.colors;
+    if (current && memcmp(current->colors, colors, sizeof(current->colors)) == 0) {
+        CORE->palette_snapshot_changed = false;
+        return;
+    }
+
+    u32 version = current ? current->version + 1 : 1;
+    PaletteSnapshot *snapshot = CORE->palette_snapshots + (version % PUN_PALETTE_SNAPSHOTS);
+    memcpy(snapshot->colors, colors, sizeof(snapshot->colors));
+    snapshot->version = version;
+    CORE->palette_snapshot = snapshot;
+    CORE->palette_snapshot_changed = true;
+}
+
 void
 punity_frame_step()
 {   
@@ -4165,8 +8827,11 @@ punity_frame_step()
     drawlist_begin(CORE->draw_list);
     // Sleep(10);
     step();
+    ASSERT_MESSAGE(CORE->canvas_stack_count == 0, "canvas_push without canvas_pop.");
     drawlist_end(CORE->draw_list);
     drawlist_clear(CORE->draw_list);
+    palettefx_update(&CORE->palette_fx, CORE->palette, CORE->time_delta);
+    palette_snapshot_update_();
     CORE->perf_step = perf_get() - perf_step_begin;
     bank_end(&stack_state);
 
@@ -4258,6 +8923,14 @@ record_begin()
     } else {
         deque_clear(&R->frames);
     }
+
+    if (R->color_tables.block_size == 0) {
+        deque_init(&R->color_tables, sizeof(GIFWColorTable) * 16);
+    } else {
+        deque_clear(&R->color_tables);
+    }
+    R->color_table = 0;
+    R->color_table_global = 0;
 }
 
 void
@@ -4295,12 +8968,23 @@ record_frame_()
     ++last->frames_count;
     ++R->frames_count;
 
-    frame->color_table.count = array_count(CORE->palette->colors);
-    for (int i = 0; i != frame->color_table.count; ++i) {
-        frame->color_table.colors[i].r = CORE->palette->colors[i].r;
-        frame->color_table.colors[i].g = CORE->palette->colors[i].g;
-        frame->color_table.colors[i].b = CORE->palette->colors[i].b;
+    const PaletteSnapshot *snapshot = CORE->palette_snapshot;
+    if (!R->color_table || R->color_table_version != snapshot->version)
+    {
+        GIFWColorTable *color_table = deque_push_t(&R->color_tables, GIFWColorTable);
+        color_table->count = array_count(snapshot->colors);
+        for (int i = 0; i != color_table->count; ++i) {
+            color_table->colors[i].r = snapshot->colors[i].r;
+            color_table->colors[i].g = snapshot->colors[i].g;
+            color_table->colors[i].b = snapshot->colors[i].b;
+        }
+        R->color_table = color_table;
+        R->color_table_version = snapshot->version;
+        if (!R->color_table_global) {
+            R->color_table_global = color_table;
+        }
     }
+    frame->color_table = R->color_table;
 
     memcpy(frame->pixels, CORE->canvas.bitmap->pixels, frame_size);
 }
@@ -4321,11 +9005,22 @@ DEQUE_WALK(record_write_frames_)
     Recorder *R = (Recorder*)user;
     RecorderFrameBlock *block = (RecorderFrameBlock*)begin;
     RecorderFrame *frame = block->frames;
+    u8 *pixels;
     for (size_t i = 0; i != block->frames_count; ++i, ++frame) {
         printf("- %d%%\n", progress);
+        pixels = frame->pixels;
+        if (R->scaled.pixels) {
+            Bitmap source = {0};
+            source.width  = CORE->window.width;
+            source.height = CORE->window.height;
+            source.pitch  = source.width;
+            source.pixels = frame->pixels;
+            bitmap_scale(&R->scaled, &source, R->scaled.width / source.width, R->filter);
+            pixels = R->scaled.pixels;
+        }
         gifw_frame(&R->gif,
-            frame->pixels,
-            &frame->color_table,
+            pixels,
+            frame->color_table == R->color_table_global ? 0 : frame->color_table,
             0, 0, R->gif.width, R->gif.height,
             (R->gif.frames_count % 3) == 0 ? 4 : 3,
             GIFWFrameDispose_NotSpecified,
@@ -4345,16 +9040,26 @@ record_end()
     }
     R->active = false;
 
+    i32 scale = maximum(1, R->scale);
+    BankState bank_state = bank_begin(CORE->stack);
+    memset(&R->scaled, 0, sizeof(Bitmap));
+    if (scale != 1) {
+        R->scaled.width  = CORE->window.width  * scale;
+        R->scaled.height = CORE->window.height * scale;
+        R->scaled.pitch  = R->scaled.width;
+        R->scaled.pixels = bank_push_t(CORE->stack, u8, R->scaled.width * R->scaled.height);
+    }
+
     printf("Writing GIF...\n");
     FILE *file = fopen("record.gif", "wb");
     if (file) {
         gifw_begin(&R->gif,
             // Size
-            CORE->window.width, CORE->window.height,
+            CORE->window.width * scale, CORE->window.height * scale,
             // Repeat
             0,
             // Color table, background
-            0, 0,
+            R->color_table_global, 0,
             // Callback
             record_write_data_, file
         );
@@ -4364,11 +9069,69 @@ record_end()
 
         fclose(file);
     }
+
+    memset(&R->scaled, 0, sizeof(Bitmap));
+    bank_end(&bank_state);
+}
+
+bool
+screenshot_save(const char *path, i32 scale, int filter)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    scale = maximum(1, scale);
+    Bitmap *canvas = CORE->canvas.bitmap;
+    BankState bank_state = bank_begin(CORE->stack);
+
+    Bitmap scaled = *canvas;
+    if (scale != 1) {
+        scaled.width  = canvas->width  * scale;
+        scaled.height = canvas->height * scale;
+        scaled.pitch  = scaled.width;
+        scaled.pixels = bank_push_t(CORE->stack, u8, scaled.width * scaled.height);
+        bitmap_scale(&scaled, canvas, scale, filter);
+    }
+
+    GIFWColorTable *color_table = bank_push_t(CORE->stack, GIFWColorTable, 1);
+    const Color *colors = CORE->palette_snapshot ? CORE->palette_snapshot->colors : CORE->palette_fx.colors;
+    color_table->count = array_count(CORE->palette_fx.colors);
+    for (int i = 0; i != color_table->count; ++i) {
+        color_table->colors[i].r = colors[i].r;
+        color_table->colors[i].g = colors[i].g;
+        color_table->colors[i].b = colors[i].b;
+    }
+
+    GIFW *gif = bank_push_t(CORE->stack, GIFW, 1);
+    gifw_begin(gif,
+        scaled.width, scaled.height,
+        // Repeat
+        0,
+        // Color table, background
+        color_table, 0,
+        record_write_data_, file
+    );
+    gifw_frame(gif,
+        scaled.pixels,
+        0,
+        0, 0, scaled.width, scaled.height,
+        0,
+        GIFWFrameDispose_NotSpecified,
+        0, 0
+    );
+    gifw_end(gif);
+
+    bank_end(&bank_state);
+    fclose(file);
+    return true;
 }
 
 #else
 void record_begin() {};
 void record_end() {};
+bool screenshot_save(const char *path, i32 scale, int filter) { return false; }
 #endif
 
 #endif // if PUNITY_LIB == 0
@@ -4394,7 +9157,7 @@ static struct
     HINSTANCE instance;
     HCURSOR cursor;
     HWND window;
-    u32 *window_buffer;
+    Present present;
     WINDOWPLACEMENT fullscreen_placement;
 
     // Initial properties for window
@@ -4979,6 +9742,8 @@ win32_window_callback_(HWND window, UINT message, WPARAM wp, LPARAM lp)
             CORE->window.viewport_max_x = CORE->window.viewport_min_x + viewport_width;
             CORE->window.viewport_max_y = CORE->window.viewport_min_y + viewport_height;
 
+            present_invalidate(&win32_.present);
+
             // https://msdn.microsoft.com/en-us/library/windows/desktop/ms648383(v=vs.85).aspx
             // TODO: ClipCursor 
 
@@ -5082,6 +9847,14 @@ WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR command_line, int sho
         window_fullscreen_toggle();
     }
 
+    i32 present_scale = 1;
+    if (CORE->window.filter == ScaleFilter_EPX) {
+        present_scale = clamp((i32)CORE->window.scale, 2, 3);
+    }
+    present_init(&win32_.present, CORE->stack,
+        CORE->window.width, CORE->window.height,
+        present_scale, CORE->window.filter, true);
+
 #ifdef PUNITY_OPENGL
     win32_gl_window_init_(win32_.window);
 
@@ -5091,20 +9864,20 @@ WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR command_line, int sho
     glBindTexture(GL_TEXTURE_2D, win32_.gl_texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    // Allocate the texture, only changed rows are uploaded per frame.
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+        win32_.present.pixels_width, win32_.present.pixels_height,
+        0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
 #else
     BITMAPINFO window_bmi = (BITMAPINFO){0};
     memset(&window_bmi, 0, sizeof(BITMAPINFO));
     window_bmi.bmiHeader.biSize = sizeof(window_bmi.bmiHeader);
-    window_bmi.bmiHeader.biWidth = CORE->window.width;
-    window_bmi.bmiHeader.biHeight = CORE->window.height;
+    window_bmi.bmiHeader.biWidth = win32_.present.pixels_width;
+    window_bmi.bmiHeader.biHeight = win32_.present.pixels_height;
     window_bmi.bmiHeader.biPlanes = 1;
     window_bmi.bmiHeader.biBitCount = 32;
     window_bmi.bmiHeader.biCompression = BI_RGB;
 #endif
-    
-    u32 *window_buffer = 0;
-    window_buffer = bank_push(CORE->stack, (CORE->window.width * 4) * CORE->window.height);
-    ASSERT(window_buffer);
 
     // Sound
 
@@ -5117,10 +9890,7 @@ WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR command_line, int sho
 
     win32_update_mouse_position_();
 
-    int x, y;
-    u32 *window_row;
-    u8 *canvas_it;
-    BankState stack_state;
+    Present *present = &win32_.present;
     MSG message;
     while (CORE->running)
     {
@@ -5144,14 +9914,7 @@ WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR command_line, int sho
             win32_sound_step_();
         }
 
-        window_row = window_buffer;
-        canvas_it = CORE->window.buffer;
-        for (y = CORE->window.height; y != 0; --y) {
-            window_row = window_buffer + ((y - 1) * CORE->window.width);
-            for (x = 0; x != CORE->window.width; ++x) {
-                *(window_row++) = CORE->palette->colors[*canvas_it++].rgba;
-            }
-        }
+        present_update(present, CORE->canvas.bitmap, CORE->palette_snapshot->colors);
 
 #if PUNITY_OPENGL
         glClearColor(
@@ -5176,7 +9939,13 @@ WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR command_line, int sho
         glLoadIdentity();
 
         glBindTexture(GL_TEXTURE_2D, win32_.gl_texture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, CORE->window.width, CORE->window.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, window_buffer);
+        if (present->dirty_max_y != present->dirty_min_y) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0,
+                0, present->dirty_min_y,
+                present->pixels_width, present->dirty_max_y - present->dirty_min_y,
+                GL_BGRA, GL_UNSIGNED_BYTE,
+                present->pixels + (present->dirty_min_y * present->pixels_width));
+        }
 
         glBegin(GL_QUADS);
             glTexCoord2f(0.0f, 0.0f); glVertex2f(0.0f, 0.0f);
@@ -5196,8 +9965,8 @@ WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR command_line, int sho
                       CORE->window.viewport_min_y,
                       CORE->window.viewport_max_x - CORE->window.viewport_min_x,
                       CORE->window.viewport_max_y - CORE->window.viewport_min_y,
-                      0, 0, CORE->window.width, CORE->window.height,
-                      window_buffer,
+                      0, 0, present->pixels_width, present->pixels_height,
+                      present->pixels,
                       &window_bmi,
                       DIB_RGB_COLORS,
                       SRCCOPY);